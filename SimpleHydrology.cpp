@@ -2,8 +2,12 @@
 #include <TinyEngine/camera>
 #include <TinyEngine/image>
 
+#include "source/profiler.h"
 #include "source/vertexpool.h"
 #include "source/world.h"
+#include "source/ensemble.h"
+#include "source/verify.h"
+#include "source/scheduler.h"
 #include "source/model.h"
 
 #include <random>
@@ -15,31 +19,129 @@ int main( int argc, char* args[] ) {
 
   assert(TINYENGINE_VERSION == "1.7");
 
-  Tiny::view.vsync = false;
-  Tiny::view.blend = false;
-  Tiny::window("Simple Hydrology", WIDTH, HEIGHT);
-  glDisable(GL_CULL_FACE);
-
   //Initialize the World
 
   World world;
 
-  if(argc >= 2){
-    World::SEED = std::stoi(args[1]);
-    srand(std::stoi(args[1]));
+  world.SEED = time(NULL);
+
+  std::string ensemble;                       //Headless Ensemble Member File
+  std::string output = "ensemble";
+  std::string trace;                          //Profiler Trace Output File
+  std::string verify;                         //Determinism Check Case File
+  std::string golden = "golden";
+  bool record = false;
+  float tolerance = 0.0f;
+  bool stats = false;                         //Print Droplet Statistics
+  Scheduler scheduler;                        //Simulation Steps per Frame
+  int threads = 0;
+  int evolve = 0;                             //Stream Power Steps before Viewing
+
+  for(int i = 1; i < argc; i++){
+    std::string arg = args[i];
+    if(arg == "--dense") world.vegetation.dense = true;
+    else if(arg == "--lazy") world.map.lazy = true;
+    else if(arg == "--uniform") world.importance = false;
+    else if(arg == "--r2") world.r2 = true;
+    else if(arg == "--adaptive") world.adaptive = true;
+    else if(arg == "--route") world.flow.seed = true;
+    else if(arg == "--dinf") world.flow.dinf = true;
+    else if(arg == "--lakes") world.flood.enabled = true;
+    else if(arg == "--evolve" && i + 1 < argc) evolve = std::stoi(args[++i]);
+    else if(arg == "--multires" && i + 1 < argc) world.levels = std::stoi(args[++i]);
+    else if(arg == "--coarse" && i + 1 < argc) world.coarsesteps = std::stoi(args[++i]);
+    else if(arg == "--interleave" && i + 1 < argc) world.interleave = std::stoi(args[++i]);
+    else if(arg == "--parallel" && i + 1 < argc) world.threads = std::stoi(args[++i]);
+    else if(arg == "--engine" && i + 1 < argc){
+      const std::string engine = args[++i];
+      if(engine == "pipe") world.engine = World::Pipes;
+      else if(engine == "droplets") world.engine = World::Droplets;
+      else if(engine == "flow") world.engine = World::Routing;
+      else if(engine == "stream") world.engine = World::StreamPower;
+      else {
+        std::cout<<"Unknown erosion engine "<<engine<<std::endl;
+        return 1;
+      }
+    }
+    else if(arg == "--fps" && i + 1 < argc){
+      const float fps = std::stof(args[++i]);
+      scheduler.target = (fps > 0.0f) ? 1.0f/fps : 0.0f;
+    }
+    else if(arg == "--rain" && i + 1 < argc){
+      std::vector<float> rain(quad::area);
+      std::ifstream in(args[++i], std::ios::binary);
+      if(!in.read((char*)&rain[0], rain.size()*sizeof(float))){
+        std::cout<<"Failed to read rainfall map "<<args[i]<<std::endl;
+        return 1;
+      }
+      world.rainfall(rain);
+    }
+    else if(arg == "--cache") world.map.cachedir = "cache";
+    else if(arg.rfind("--cache=", 0) == 0) world.map.cachedir = arg.substr(8);
+    else if(arg == "--ensemble" && i + 1 < argc) ensemble = args[++i];
+    else if(arg == "--out" && i + 1 < argc) output = args[++i];
+    else if(arg == "--threads" && i + 1 < argc) threads = std::stoi(args[++i]);
+    else if(arg == "--trace" && i + 1 < argc) trace = args[++i];
+    else if(arg == "--stats") stats = true;
+    else if(arg == "--verify" && i + 1 < argc) verify = args[++i];
+    else if(arg == "--golden" && i + 1 < argc) golden = args[++i];
+    else if(arg == "--record") record = true;
+    else if(arg == "--tolerance" && i + 1 < argc) tolerance = std::stof(args[++i]);
+    else if(!arg.empty() && arg.size() <= 9 && arg.find_first_not_of("0123456789") == std::string::npos)
+      world.SEED = std::stoi(arg);
+    else {
+      std::cout<<"Unknown argument "<<arg<<std::endl;
+      std::cout<<"Usage: ./hydrology [SEED] [--dense] [--lazy] [--cache[=DIR]] [--stats] [--uniform] [--rain FILE] [--r2] [--adaptive] [--interleave K] [--parallel N] [--engine pipe|flow|stream|droplets] [--route] [--dinf] [--lakes] [--evolve N] [--multires L] [--coarse N] [--fps N]"<<std::endl;
+      std::cout<<"       ./hydrology --ensemble FILE [--out DIR] [--threads N]"<<std::endl;
+      std::cout<<"       ./hydrology --verify FILE [--golden DIR] [--record] [--tolerance EPS] [--threads N]"<<std::endl;
+      return 1;
+    }
+  }
+
+  if(!verify.empty()){
+    const bool success = verify::run(verify, golden, record, tolerance, threads, world, cellpool);
+    if(!trace.empty()) profiler::dump(trace);
+    return success ? 0 : 1;
   }
-  else {
-    World::SEED = time(NULL);
-    srand(World::SEED);
+
+  if(!ensemble.empty()){
+    const bool success = ensemble::run(ensemble, output, threads, world, cellpool);
+    if(!trace.empty()) profiler::dump(trace);
+    return success ? 0 : 1;
   }
 
+  Tiny::view.vsync = false;
+  Tiny::view.blend = false;
+  Tiny::window("Simple Hydrology", WIDTH, HEIGHT);
+  glDisable(GL_CULL_FACE);
+
   cellpool.reserve(quad::area);
   vertexpool.reserve(quad::tilearea, quad::maparea);
-  World::map.init(vertexpool, cellpool, World::SEED);
+  world.vegetation.tracked = true;            //Only the Renderer Clears Changes
+  world.init(cellpool);
+  world.map.index(vertexpool);
+
+  //Shape a Base Terrain by Landscape Evolution, refined by the Engine
+
+  if(evolve > 0){
+    const World::Engine engine = world.engine;
+    world.engine = World::StreamPower;
+    for(int step = 0; step < evolve; step++)
+      world.erode(quad::tilesize);
+    world.engine = engine;
+  }
+
+  //Carve the Drainage at Coarse Cell Sizes first
+
+  if(world.levels > 1)
+    multires::run(world);
 
   //Vertexpool for Drawing Surface
+  //  The renderer draws every node, so lazy nodes are materialized here.
 
   for(auto& node: world.map.nodes){
+    if(!node.generated)
+      world.map.generate(node);
     updatenode(vertexpool, node);
   }
 
@@ -61,8 +163,8 @@ int main( int argc, char* args[] ) {
   Shader defaultshader({"source/shader/default.vs", "source/shader/default.fs"}, {"in_Position", "in_Normal", "in_Tangent", "in_Bitangent"});
   Shader defaultdepth({"source/shader/depth.vs", "source/shader/depth.fs"}, {"in_Position"});
 
-  Shader treeshader({"source/shader/tree.vs", "source/shader/tree.fs"}, {"in_Pos", "in_Model"});
-  Shader treedepth({"source/shader/treedepth.vs", "source/shader/treedepth.fs"}, {"in_Pos", "in_Model"});
+  Shader treeshader({"source/shader/tree.vs", "source/shader/tree.fs"}, {"in_Pos", "in_Instance"});
+  Shader treedepth({"source/shader/treedepth.vs", "source/shader/treedepth.fs"}, {"in_Pos", "in_Instance"});
 
   Shader ssaoshader({"source/shader/ssao.vs", "source/shader/ssao.fs"}, {"in_Quad", "in_Tex"});
   Shader imageshader({"source/shader/image.vs", "source/shader/image.fs"}, {"in_Quad", "in_Tex"});
@@ -159,8 +261,10 @@ int main( int argc, char* args[] ) {
 
   Instance treeparticle(&conemodel);	//Particle system based on this model
   Buffer modelbuf;
-  treeparticle.bind<glm::mat4>("in_Model", &modelbuf);			//Update treeparticle system
-  std::vector<glm::mat4> treemodels;
+  treeparticle.bind<glm::vec4>("in_Instance", &modelbuf);			//Update treeparticle system
+  size_t treecapacity = 0;                    //Allocated Instance Buffer Size
+  std::vector<glm::vec4> treeinstances;
+  std::vector<Plant> treesamples;             //Instances Sampled from Density
 
   //Texture for Hydrological Map Visualization
 
@@ -234,7 +338,7 @@ int main( int argc, char* args[] ) {
     defaultshader.uniform("steepColor", steepColor);
     vertexpool.render(GL_TRIANGLES);
 
-    if(!Vegetation::plants.empty()){
+    if(treeparticle.SIZE > 0){
 
       glm::mat4 orient = glm::rotate(glm::mat4(1.0f), glm::radians(180.0f-cam::rot), glm::vec3(0.0, 1.0, 0.0));
 
@@ -242,6 +346,9 @@ int main( int argc, char* args[] ) {
       treeshader.uniform("proj", cam::proj);
       treeshader.uniform("view", cam::view);
       treeshader.uniform("color", treeColor);
+      treeshader.uniform("tick", (float)world.vegetation.tick);
+      treeshader.uniform("growRate", world.plant.growRate);
+      treeshader.uniform("maxSize", world.plant.maxSize);
       treeparticle.render(GL_TRIANGLES);
 
     }
@@ -266,11 +373,14 @@ int main( int argc, char* args[] ) {
     defaultdepth.uniform("dvp", dvp);
     vertexpool.render(GL_TRIANGLES);  //Render Surface Model
 
-    if(!Vegetation::plants.empty()){
+    if(treeparticle.SIZE > 0){
 
       //Render the Trees as a Particle System
       treedepth.use();
       treedepth.uniform("dvp", dvp);
+      treedepth.uniform("tick", (float)world.vegetation.tick);
+      treedepth.uniform("growRate", world.plant.growRate);
+      treedepth.uniform("maxSize", world.plant.maxSize);
       treeparticle.render(GL_TRIANGLES);
 
     }
@@ -316,35 +426,117 @@ int main( int argc, char* args[] ) {
     if(paused)
       return;
 
-    world.erode(quad::tilesize); //Execute Erosion Cycles
-    Vegetation::grow();     //Grow Trees
+    //Execute Erosion Cycles and Grow Trees, as the Frame Time allows
+    //Grid engines cost the same for every step, measured per cell
+
+    auto work = [&](){
+      return (world.engine != World::Droplets) ? (size_t)quad::area : world.stats.spawned;
+    };
+
+    const int steps = scheduler.plan(work(), world.vegetation.plants.size());
+
+    for(int step = 0; step < steps; step++){
+
+      const double erosion = scheduler.time([&](){ world.erode(quad::tilesize); });
+      scheduler.erode(erosion, work());
+
+      const double growth = scheduler.time([&](){ world.vegetation.grow(world); });
+      scheduler.grow(growth, world.vegetation.plants.size());
+
+      cout<<n++<<endl;
+      if(stats){
+        cout<<"residual "<<world.residual<<" ";
+        world.stats.print(cout);
+      }
+
+    }
+
+    if(steps == 0)
+      return;
 
-    for(auto& node: world.map.nodes){
-      updatenode(vertexpool, node);
+    {
+      PROFILE("updatenode");
+      for(auto& node: world.map.nodes){
+        updatenode(vertexpool, node);
+      }
     }
-    cout<<n++<<endl;
 
     //Update the Tree Particle System
 
-    treemodels.clear();
-    for(auto& t: Vegetation::plants){
-      glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(t.pos.x, t.size + quad::mapscale*world.map.get(t.pos)->get(t.pos)->height, t.pos.y));
-      model = glm::scale(model, glm::vec3(t.size));
-      treemodels.push_back(model);
+    if(world.vegetation.dense){
+
+      PROFILE("trees.sample");
+
+      world.vegetation.sample(world, treesamples);
+      treeinstances.clear();
+      for(auto& t: treesamples)
+        treeinstances.push_back(Vegetation::instance(world, t));
+      if(!treeinstances.empty())
+        modelbuf.fill(treeinstances);
+      treeparticle.SIZE = treeinstances.size();
+
     }
-    modelbuf.fill(treemodels);
-    treeparticle.SIZE = treemodels.size();    //  cout<<world.trees.size()<<endl;
 
+    else {
+
+      PROFILE("trees.upload");
+
+      auto& instances = world.vegetation.instances;
+      auto& dirty = world.vegetation.dirty;
+
+      glBindBuffer(GL_ARRAY_BUFFER, modelbuf.index);
+
+      if(instances.size() > treecapacity){
+
+        // Grow Geometrically, Upload Everything Once
+
+        treecapacity = 2*instances.size();
+        glBufferData(GL_ARRAY_BUFFER, treecapacity*sizeof(glm::vec4), NULL, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size()*sizeof(glm::vec4), &instances[0]);
+
+      }
+
+      else {
+
+        // Upload Contiguous Runs of Changed Instances
+
+        std::sort(dirty.begin(), dirty.end());
+        for(size_t a = 0; a < dirty.size();){
+
+          size_t b = a;
+          while(b + 1 < dirty.size() && dirty[b+1] <= dirty[b] + 1)
+            b++;
+
+          const size_t lo = dirty[a];
+          const size_t hi = std::min((size_t)dirty[b] + 1, instances.size());
+          if(lo < hi)
+            glBufferSubData(GL_ARRAY_BUFFER, lo*sizeof(glm::vec4), (hi - lo)*sizeof(glm::vec4), &instances[lo]);
+
+          a = b + 1;
+
+        }
+
+      }
+
+      dirty.clear();
+      treeparticle.SIZE = instances.size();
+
+    }
 
     // Update Maps
 
+    {
+    PROFILE("dischargeMap");
     dischargeMap.raw(image::make([&](const ivec2 p){
-      double d = World::map.discharge(p);
-  //    if(World::map.height(p) < 0.3)
-  //      d = 1.0;
+      double d = world.map.discharge(p);
+      if(world.lakes.lake(p, world.map.height(p)))
+        d = 1.0;
       return vec4(waterColor, d);
     }, quad::res));
+    }
 
+    {
+    PROFILE("momentumMap");
     momentumMap.raw(image::make([&](const ivec2 p){
       auto node = world.map.get(p);
       auto cell = node->get(p);
@@ -352,8 +544,12 @@ int main( int argc, char* args[] ) {
       float my = cell->momentumy;
       return glm::vec4(0.5f*(1.0f+erf(mx)), 0.5f*(1.0f+erf(my)), 0.5f, 1.0);
     }, quad::res));
+    }
 
   });
 
+  if(!trace.empty())
+    profiler::dump(trace);
+
   return 0;
 }
@@ -0,0 +1,156 @@
+#ifndef SIMPLEHYDROLOGY_CACHE
+#define SIMPLEHYDROLOGY_CACHE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+
+/*
+================================================================================
+                    Persistent Base Terrain Cache
+================================================================================
+  Normalized base heightfields are stored in a content-addressed directory,
+  keyed by a hash of all generator inputs. A file is a small header followed
+  by the raw float height plane in world order, so that it can be mapped
+  directly into memory instead of being regenerated.
+*/
+
+namespace cache {
+
+const uint32_t version = 1;
+
+struct header {
+  char magic[4] = {'S', 'H', 'H', 'F'};
+  uint32_t version = cache::version;
+  int32_t resx = 0;
+  int32_t resy = 0;
+  float hmin = 0.0f;              // Normalization Range
+  float hmax = 0.0f;
+};
+
+// FNV-1a Hash of the Generator Inputs
+
+std::string key(const void* data, size_t size){
+
+  uint64_t h = 14695981039346656037ULL;
+  const unsigned char* b = (const unsigned char*)data;
+  for(size_t i = 0; i < size; i++){
+    h ^= b[i];
+    h *= 1099511628211ULL;
+  }
+
+  char s[17];
+  snprintf(s, sizeof(s), "%016llx", (unsigned long long)h);
+  return s;
+
+}
+
+// Read-Only Memory Mapped File
+
+struct mapping {
+
+  void* data = NULL;
+  size_t size = 0;
+
+  mapping(){}
+  mapping(const mapping&) = delete;
+  mapping& operator=(const mapping&) = delete;
+
+  ~mapping(){
+    close();
+  }
+
+  bool open(std::string path, ivec2 res){
+
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(cache::header)){
+      ::close(fd);
+      return false;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if(data == MAP_FAILED){
+      data = NULL;
+      return false;
+    }
+
+    size = st.st_size;
+
+    // Validate the Header
+
+    const cache::header* h = head();
+    if(memcmp(h->magic, cache::header().magic, 4) != 0
+    || h->version != cache::version
+    || h->resx != res.x || h->resy != res.y
+    || size != sizeof(cache::header) + (size_t)res.x*res.y*sizeof(float)){
+      close();
+      return false;
+    }
+
+    return true;
+
+  }
+
+  void close(){
+    if(data != NULL)
+      munmap(data, size);
+    data = NULL;
+    size = 0;
+  }
+
+  const cache::header* head() const {
+    return (const cache::header*)data;
+  }
+
+  const float* height() const {
+    return (const float*)((const char*)data + sizeof(cache::header));
+  }
+
+};
+
+// Write a Height Plane, Atomically via Rename
+
+bool store(std::string dir, std::string path, const cache::header& h, std::function<float(ivec2)> height){
+
+  mkdir(dir.c_str(), 0755);
+
+  // Unique per Process and Thread, Members may Store the same Terrain
+
+  static std::atomic<unsigned int> writes(0);
+  std::string tmp = path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(writes++);
+  FILE* file = fopen(tmp.c_str(), "wb");
+  if(file == NULL)
+    return false;
+
+  bool ok = fwrite(&h, sizeof(cache::header), 1, file) == 1;
+
+  std::vector<float> row(h.resy);
+  for(int x = 0; x < h.resx && ok; x++){
+    for(int y = 0; y < h.resy; y++)
+      row[y] = height(ivec2(x, y));
+    ok = fwrite(&row[0], sizeof(float), h.resy, file) == (size_t)h.resy;
+  }
+
+  ok = (fclose(file) == 0) && ok;
+
+  if(!ok || rename(tmp.c_str(), path.c_str()) != 0){
+    remove(tmp.c_str());
+    return false;
+  }
+
+  return true;
+
+}
+
+}; // namespace cache
+
+#endif
@@ -1,6 +1,11 @@
 #ifndef SIMPLEHYDROLOGY_CELLPOOL
 #define SIMPLEHYDROLOGY_CELLPOOL
 
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <atomic>
+
 /*
 ================================================================================
                     Interleaved Cell Data Memory Pool
@@ -104,6 +109,7 @@ struct pool {
 
   buf<T> root;
   deque<buf<T>> free;
+  std::mutex lock;
 
   pool(){}
   pool(size_t _size){
@@ -125,20 +131,42 @@ struct pool {
 
   buf<T> get(size_t _size){
 
+    std::lock_guard<std::mutex> guard(lock);
+
     if(free.empty())
       return {NULL, 0};
 
     if(_size > root.size)
       return {NULL, 0};
 
-    if(free.front().size < _size)
-      return {NULL, 0};
+    // First Fitting Free Section
+
+    for(auto& f: free){
+
+      if(f.size < _size)
+        continue;
+
+      buf<T> sec = {f.start, _size};
+      f.start += _size;
+      f.size -= _size;
+
+      return sec;
+
+    }
 
-    buf<T> sec = {free.front().start, _size};
-    free.front().start += _size;
-    free.front().size -= _size;
+    return {NULL, 0};
 
-    return sec;
+  }
+
+  // Return a Section for Reuse
+
+  void release(buf<T> sec){
+
+    if(sec.start == NULL)
+      return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    free.push_back(sec);
 
   }
 
@@ -175,27 +203,30 @@ const int size = mapsize*tilesize;
 const int area = maparea*tilearea;
 const ivec2 res = ivec2(size);
 
-const int lodsize = 1;
+const int lodsize = 1;                  // Default Cell Size of a Map
 const int lodarea = lodsize*lodsize;
 
+// Surface Normal of a Height Accessor T with oob, height and its Cell Size lod
+
 template<typename T>
 vec3 _normal(T& t, ivec2 p){
 
   vec3 n = vec3(0, 0, 0);
   const vec3 s = vec3(1.0, quad::mapscale, 1.0);
+  const int lod = t.lod;
 
-  if(!t.oob(p + quad::lodsize*ivec2( 1, 1)))
-    n += cross( s*vec3( 0.0, t.height(p+quad::lodsize*ivec2( 0, 1)) - t.height(p), 1.0), s*vec3( 1.0, t.height(p+quad::lodsize*ivec2( 1, 0)) - t.height(p), 0.0));
+  if(!t.oob(p + lod*ivec2( 1, 1)))
+    n += cross( s*vec3( 0.0, t.height(p+lod*ivec2( 0, 1)) - t.height(p), 1.0), s*vec3( 1.0, t.height(p+lod*ivec2( 1, 0)) - t.height(p), 0.0));
 
-  if(!t.oob(p + quad::lodsize*ivec2(-1,-1)))
-    n += cross( s*vec3( 0.0, t.height(p-quad::lodsize*ivec2( 0, 1)) - t.height(p),-1.0), s*vec3(-1.0, t.height(p-quad::lodsize*ivec2( 1, 0)) - t.height(p), 0.0));
+  if(!t.oob(p + lod*ivec2(-1,-1)))
+    n += cross( s*vec3( 0.0, t.height(p-lod*ivec2( 0, 1)) - t.height(p),-1.0), s*vec3(-1.0, t.height(p-lod*ivec2( 1, 0)) - t.height(p), 0.0));
 
   //Two Alternative Planes (+X -> -Y) (-X -> +Y)
-  if(!t.oob(p + quad::lodsize*ivec2( 1,-1)))
-    n += cross( s*vec3( 1.0, t.height(p+quad::lodsize*ivec2( 1, 0)) - t.height(p), 0.0), s*vec3( 0.0, t.height(p-quad::lodsize*ivec2( 0, 1)) - t.height(p),-1.0));
+  if(!t.oob(p + lod*ivec2( 1,-1)))
+    n += cross( s*vec3( 1.0, t.height(p+lod*ivec2( 1, 0)) - t.height(p), 0.0), s*vec3( 0.0, t.height(p-lod*ivec2( 0, 1)) - t.height(p),-1.0));
 
-  if(!t.oob(p + quad::lodsize*ivec2(-1, 1)))
-    n += cross( s*vec3(-1.0, t.height(p-quad::lodsize*ivec2( 1, 0)) - t.height(p), 0.0), s*vec3( 0.0, t.height(p+quad::lodsize*ivec2( 0, 1)) - t.height(p), 1.0));
+  if(!t.oob(p + lod*ivec2(-1, 1)))
+    n += cross( s*vec3(-1.0, t.height(p-lod*ivec2( 1, 0)) - t.height(p), 0.0), s*vec3( 0.0, t.height(p+lod*ivec2( 0, 1)) - t.height(p), 1.0));
 
   if(length(n) > 0)
     n = normalize(n);
@@ -216,6 +247,7 @@ struct cell {
   float momentumy_track;
 
   float rootdensity;
+  float density;          // Continuous Vegetation Density
 
 };
 
@@ -224,13 +256,17 @@ struct node {
   ivec2 pos = ivec2(0);   // Absolute World Position
   uint* vertex = NULL;    // Vertexpool Rendering Pointer
   mappool::slice<cell> s; // Raw Interleaved Data Slices
+  bool generated = false; // Height has been Generated
+  int lod = lodsize;      // Cell Size, in World Cells
+
+  std::shared_ptr<cell> block;  // Slice Ownership, Shared between Forks
 
   inline cell* get(const ivec2 p){
-    return s.get((p - pos)/lodsize);
+    return s.get((p - pos)/lod);
   }
 
   const inline bool oob(const ivec2 p){
-    return s.oob((p - pos)/lodsize);
+    return s.oob((p - pos)/lod);
   }
 
   const inline float height(ivec2 p){
@@ -253,20 +289,20 @@ void indexnode(Vertexpool<Vertex>& vertexpool, quad::node& t){
 
   // Iterate over the Node's Slice
   for(const auto& [cell, pos]: t.s){
-    if(pos.x == tilesize/lodsize - 1) continue;
-    if(pos.y == tilesize/lodsize - 1) continue;
-    vertexpool.indices.push_back(math::flatten(pos + ivec2(0, 0), tileres/lodsize));
-    vertexpool.indices.push_back(math::flatten(pos + ivec2(0, 1), tileres/lodsize));
-    vertexpool.indices.push_back(math::flatten(pos + ivec2(1, 0), tileres/lodsize));
-    vertexpool.indices.push_back(math::flatten(pos + ivec2(1, 0), tileres/lodsize));
-    vertexpool.indices.push_back(math::flatten(pos + ivec2(0, 1), tileres/lodsize));
-    vertexpool.indices.push_back(math::flatten(pos + ivec2(1, 1), tileres/lodsize));
+    if(pos.x == tilesize/t.lod - 1) continue;
+    if(pos.y == tilesize/t.lod - 1) continue;
+    vertexpool.indices.push_back(math::flatten(pos + ivec2(0, 0), tileres/t.lod));
+    vertexpool.indices.push_back(math::flatten(pos + ivec2(0, 1), tileres/t.lod));
+    vertexpool.indices.push_back(math::flatten(pos + ivec2(1, 0), tileres/t.lod));
+    vertexpool.indices.push_back(math::flatten(pos + ivec2(1, 0), tileres/t.lod));
+    vertexpool.indices.push_back(math::flatten(pos + ivec2(0, 1), tileres/t.lod));
+    vertexpool.indices.push_back(math::flatten(pos + ivec2(1, 1), tileres/t.lod));
   }
 
   // Side-Drapes
 
   /*
-  for(size_t i = 0; i < tilesize/lodsize - 1; i++){
+  for(size_t i = 0; i < tilesize/t.lod - 1; i++){
     vertexpool.indices.push_back(i);
     vertexpool.indices.push_back(tilesize + i);
     vertexpool.indices.push_back(tilesize + i + 1);
@@ -287,15 +323,15 @@ void updatenode(Vertexpool<Vertex>& vertexpool, quad::node& t){
 
   for(auto [cell, pos]: t.s){
 
-    glm::vec2 p = t.pos + lodsize*pos;
-    glm::vec2 pT = t.pos + lodsize*(pos + ivec2( 1, 0));
-    glm::vec2 pB = t.pos + lodsize*(pos + ivec2( 0, 1));
+    glm::vec2 p = t.pos + t.lod*pos;
+    glm::vec2 pT = t.pos + t.lod*(pos + ivec2( 1, 0));
+    glm::vec2 pB = t.pos + t.lod*(pos + ivec2( 0, 1));
 
     glm::vec3 P = glm::vec3(p.x, quad::mapscale*t.height(p), p.y);
     glm::vec3 T = glm::vec3(pT.x, quad::mapscale*t.height(pT), pT.y);
     glm::vec3 B = glm::vec3(pB.x, quad::mapscale*t.height(pB), pB.y);
 
-    vertexpool.fill(t.vertex, math::flatten(pos, tileres/lodsize),
+    vertexpool.fill(t.vertex, math::flatten(pos, tileres/t.lod),
       P,
       t.normal(p),
       T - P,
@@ -305,7 +341,7 @@ void updatenode(Vertexpool<Vertex>& vertexpool, quad::node& t){
   }
 
   /*
-  for(size_t i = 0; i < tilesize/lodsize; i++){
+  for(size_t i = 0; i < tilesize/t.lod; i++){
     vertexpool.fill(t.vertex, tilesize + i,
       glm::vec3(0, -10, i),
       glm::vec3(1, 0, 0),
@@ -316,11 +352,63 @@ void updatenode(Vertexpool<Vertex>& vertexpool, quad::node& t){
 
 }
 
+// Split Work over Hardware Threads
+//  Work split again from inside a worker runs on that worker, so that
+//  nested regions (e.g. generation on first access) start no threads.
+
+inline thread_local bool nested = false;
+
+template<typename F>
+void parallel(F&& work, int nthreads = 0){
+  if(nthreads <= 0)
+    nthreads = std::max(1u, std::thread::hardware_concurrency());
+  if(nthreads == 1 || nested){
+    work(0, 1);
+    return;
+  }
+  std::vector<std::thread> threads;
+  for(int t = 0; t < nthreads; t++)
+    threads.emplace_back([work](int t, int n) mutable {
+      nested = true;
+      work(t, n);
+    }, t, nthreads);
+  for(auto& thread: threads)
+    thread.join();
+}
+
 struct map {
 
   node nodes[maparea];
 
-  void init(Vertexpool<Vertex>& vertexpool, mappool::pool<cell>& cellpool, int SEED){
+  // Height Generator
+
+  static const int octaves = 8;
+
+  FastNoiseLite noise[octaves];   // Noise Generators, one per Octave
+  float scale[octaves];
+  float z = 0.0f;                 // Seed Noise Slice
+
+  float frequency = 1.0f;         // First Octave Frequency
+  float lacunarity = 2.0f;        // Octave Frequency Multiplier
+  float amplitude = 0.6f;         // First Octave Scale
+  double gain = 0.6;             // Octave Scale Multiplier
+
+  std::string cachedir;           // Base Terrain Cache (Empty: Disabled)
+  std::string cachepath;
+  cache::mapping cached;
+
+  mappool::pool<cell>* pool = NULL;
+  int threads = 0;                // Generation Threads (0: Hardware)
+
+  bool lazy = false;              // Generate Nodes on First Access
+  std::mutex generating;          // Held while a Node is Generated
+  int lod = lodsize;              // Cell Size, in World Cells
+  float hmin = 0.0f;              // Height Normalization Range
+  float hmax = 0.0f;
+
+  void init(mappool::pool<cell>& cellpool, int SEED){
+
+    pool = &cellpool;
 
     // Generate the Node Array
 
@@ -331,11 +419,12 @@ struct map {
 
       nodes[ind] = {
         tileres*ivec2(i, j),
-        vertexpool.section(tilearea/lodarea, 0, glm::vec3(0), vertexpool.indices.size()),
-        { cellpool.get(tilearea/lodarea), tileres/lodsize }
+        NULL,
+        { {NULL, 0}, tileres/lod },
+        false, lod, {}
       };
 
-      indexnode(vertexpool, nodes[ind]);
+      nodes[ind].block = allocate(nodes[ind].s.root);
 
     }
 
@@ -344,70 +433,372 @@ struct map {
     std::cout<<"Generating New World"<<std::endl;
     std::cout<<"Seed: "<<SEED<<std::endl;
 
-    std::cout<<"... generating height ..."<<std::endl;
+    float f = frequency;
+    float s = amplitude;
 
-    static FastNoiseLite noise; //Noise System
-    noise.SetNoiseType(FastNoiseLite::NoiseType_OpenSimplex2);
-    noise.SetFractalType(FastNoiseLite::FractalType_FBm);
+    for(int o = 0; o < octaves; o++){
 
+      noise[o].SetNoiseType(FastNoiseLite::NoiseType_OpenSimplex2);
+      noise[o].SetFractalType(FastNoiseLite::FractalType_FBm);
+      noise[o].SetFrequency(f);
+      scale[o] = s;
 
-    for(auto& node: nodes){
+      f *= lacunarity;
+      s *= gain;
 
-      for(auto [cell, pos]: node.s)
-        cell.height = 0.0f;
+    }
 
-      // Add Layers of Noise
+    z = (float)(SEED%10000);
 
-      float frequency = 1.0f;
-      float scale = 0.6f;
+    // Map a Cached Base Terrain of the same Generator Inputs
 
-      for(size_t o = 0; o < 8; o++){
+    std::string path;
 
-        noise.SetFrequency(frequency);
+    if(!cachedir.empty()){
 
-        for(auto [cell, pos]: node.s){
+      const struct {
+        int seed, octaves, fractal, tilesize, mapsize, lodsize;
+        float frequency, lacunarity, amplitude, gain;
+      } inputs = {
+        SEED, octaves, 3, tilesize, mapsize, lod,
+        frequency, lacunarity, amplitude, (float)gain
+      };
 
-          vec2 p = vec2(node.pos+lodsize*pos)/vec2(quad::tileres);
-          cell.height += scale*noise.GetNoise(p.x, p.y, (float)(SEED%10000));
+      path = cachedir + "/" + cache::key(&inputs, sizeof(inputs)) + ".height";
+      cachepath = path;
 
-        }
+      if(cached.open(path, res/lod)){
+
+        std::cout<<"... mapping cached height ..."<<std::endl;
+
+        hmin = cached.head()->hmin;
+        hmax = cached.head()->hmax;
 
-        frequency *= 2;
-        scale *= 0.6;
+        if(lazy)
+          return;
+
+        const int rows = tileres.x/lod;
+        parallel([&](int t, int n){
+          for(auto& node: nodes)
+          for(int x = t; x < rows; x += n)
+            load(node, x);
+        }, threads);
+
+        for(auto& node: nodes)
+          node.generated = true;
+
+        cached.close();
+        return;
 
       }
 
     }
 
-    float min = 0.0f;
-    float max = 0.0f;
+    // Lazy: Normalize by a Sampled Range, Generate on Access
+
+    if(lazy){
+
+      std::cout<<"... sampling height range ..."<<std::endl;
+
+      const int samples = 256;
+
+      hmin = 0.0f;
+      hmax = 0.0f;
+
+      for(int i = 0; i < samples; i++)
+      for(int j = 0; j < samples; j++){
+        const float h = sample(vec2(res)*(vec2(i, j) + 0.5f)/(float)samples);
+        hmin = (hmin < h)?hmin:h;
+        hmax = (hmax > h)?hmax:h;
+      }
+
+      return;
 
-    for(auto& node: nodes)
-    for(auto [cell, pos]: node.s){
-      min = (min < cell.height)?min:cell.height;
-      max = (max > cell.height)?max:cell.height;
     }
 
-    noise.SetNoiseType(FastNoiseLite::NoiseType_OpenSimplex2);
-    noise.SetFractalType(FastNoiseLite::FractalType_FBm);
-    noise.SetFractalOctaves(1.0f);
-    noise.SetFractalLacunarity(2.0f);
-    noise.SetFractalGain(0.6f);
-    noise.SetFrequency(1.0);
+    // Eager: Generate Everything, Normalize by the Exact Range
+    //  Rows are split over threads, and the range is reduced per thread.
+
+    std::cout<<"... generating height ..."<<std::endl;
+
+    const int rows = tileres.x/lod;
+    const int nthreads = (threads > 0)?threads:std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<float> tmin(nthreads, 0.0f);
+    std::vector<float> tmax(nthreads, 0.0f);
+
+    parallel([&](int t, int n){
+      for(auto& node: nodes)
+      for(int x = t; x < rows; x += n){
+        for(const auto& c: generate(node, x)){
+          tmin[t] = (tmin[t] < c.height)?tmin[t]:c.height;
+          tmax[t] = (tmax[t] > c.height)?tmax[t]:c.height;
+        }
+      }
+    }, nthreads);
+
+    hmin = *std::min_element(tmin.begin(), tmin.end());
+    hmax = *std::max_element(tmax.begin(), tmax.end());
+
+    parallel([&](int t, int n){
+      for(auto& node: nodes)
+      for(int x = t; x < rows; x += n)
+        normalize(node, x);
+    }, nthreads);
 
     for(auto& node: nodes)
-    for(auto [cell, pos]: node.s){
+      node.generated = true;
+
+    if(!path.empty()){
+      cache::header h;
+      h.resx = res.x/lod;
+      h.resy = res.y/lod;
+      h.hmin = hmin;
+      h.hmax = hmax;
+      if(!cache::store(cachedir, path, h, [&](ivec2 p){ return height(lod*p); }))
+        std::cout<<"... failed to write height cache ..."<<std::endl;
+    }
+
+  }
+
+  // Downsample a Map into this one at a coarser Cell Size
+  //  Every cell averages the lod x lod block of finer cells it covers.
+
+  void coarsen(map& fine, int coarse){
+
+    lod = coarse;
+    pool = NULL;
+    hmin = fine.hmin;
+    hmax = fine.hmax;
+
+    const int k = lod/fine.lod;
+
+    for(int i = 0; i < maparea; i++){
+
+      node& src = fine.nodes[i];
+      if(!src.generated)
+        fine.generate(src);
+
+      nodes[i] = { src.pos, NULL, { {NULL, 0}, tileres/lod }, false, lod, {} };
+      nodes[i].block = allocate(nodes[i].s.root);
+
+      for(auto [c, pos]: nodes[i].s){
+        c = cell{};
+        for(int x = 0; x < k; x++)
+        for(int y = 0; y < k; y++){
+          const cell& f = *src.s.get(k*pos + ivec2(x, y));
+          c.height += f.height;
+          c.discharge += f.discharge;
+          c.momentumx += f.momentumx;
+          c.momentumy += f.momentumy;
+          c.rootdensity += f.rootdensity;
+        }
+        c.height /= k*k;
+        c.discharge /= k*k;
+        c.momentumx /= k*k;
+        c.momentumy /= k*k;
+        c.rootdensity /= k*k;
+      }
+
+      nodes[i].generated = true;
+
+    }
 
-      vec2 p = vec2(node.pos+lodsize*pos)/vec2(quad::tileres);
-    //  vec2 cp = p+;
-      float scale = noise.GetNoise(p.x, p.y, (float)(SEED%10000+1));
-      float d = 0.1+0.5f*(1.0f+erf(2*scale));
+  }
+
+  // Return the Node Slices to the Pool
+
+  void release(){
+    for(auto& node: nodes){
+      node.block.reset();
+      node.s.root = {NULL, 0};
+      node.generated = false;
+    }
+  }
+
+  // Slice Allocation: Pool Sections return to the Pool when unreferenced.
+  //  Forks can exceed the reserved pool, in which case the heap is used.
+
+  std::shared_ptr<cell> allocate(mappool::buf<cell>& sec){
+
+    const size_t size = tilearea/(lod*lod);
+
+    if(pool != NULL)
+      sec = pool->get(size);
+
+    if(sec.start != NULL){
+      mappool::pool<cell>* p = pool;
+      mappool::buf<cell> b = sec;
+      return std::shared_ptr<cell>(sec.start, [p, b](cell*){ p->release(b); });
+    }
+
+    sec = {new cell[size], size};
+    return std::shared_ptr<cell>(sec.start, [](cell* c){ delete[] c; });
+
+  }
+
+  /*
+    Copy-on-Write Forking
+
+    A fork shares all node slices with its parent. Any write goes through
+    unshare, which copies a node's slice the first time it is written while
+    still referenced by another fork, so that a branch only pays memory for
+    the nodes that it actually changes. Shared slices are never written.
+  */
+
+  void fork(map& branch){
+
+    for(int i = 0; i < maparea; i++){
+      branch.nodes[i] = nodes[i];
+      branch.nodes[i].vertex = NULL;
+    }
+
+    for(int o = 0; o < octaves; o++){
+      branch.noise[o] = noise[o];
+      branch.scale[o] = scale[o];
+    }
+
+    branch.z = z;
+    branch.frequency = frequency;
+    branch.lacunarity = lacunarity;
+    branch.amplitude = amplitude;
+    branch.gain = gain;
+    branch.pool = pool;
+    branch.threads = threads;
+    branch.lazy = lazy;
+    branch.lod = lod;
+    branch.hmin = hmin;
+    branch.hmax = hmax;
+    branch.cachedir = cachedir;
+    branch.cachepath = cachepath;
+
+    if(cached.data != NULL)
+      branch.cached.open(cachepath, res/lod);
+
+  }
+
+  inline void unshare(node& n){
+
+    if(n.block.use_count() <= 1)
+      return;
+
+    mappool::buf<cell> sec = {NULL, 0};
+    std::shared_ptr<cell> block = allocate(sec);
+
+    if(n.generated)
+      std::copy(n.s.root.start, n.s.root.start + sec.size, sec.start);
+
+    n.s.root = sec;
+    n.block = block;
+
+  }
+
+  // Writable Cell Access
+
+  inline cell* write(ivec2 p){
+    if(oob(p)) return NULL;
+    node* n = get(p);
+    unshare(*n);
+    return n->get(p);
+  }
+
+  // Section the Vertexpool for Rendering
+
+  void index(Vertexpool<Vertex>& vertexpool){
+    for(auto& node: nodes){
+      node.vertex = vertexpool.section(tilearea/(lod*lod), 0, glm::vec3(0), vertexpool.indices.size());
+      indexnode(vertexpool, node);
+    }
+  }
+
+  // Raw Height at a Single Position
 
-    // /  float cd = sqrt(dot(cp, cp)/(0.07*size*size));
-      //cell.height = d;
-      cell.height = ((cell.height - min)/(max - min));
+  float sample(vec2 p){
+    p /= vec2(quad::tileres);
+    float h = 0.0f;
+    for(int o = 0; o < octaves; o++)
+      h += scale[o]*noise[o].GetNoise(p.x, p.y, z);
+    return h;
+  }
+
+  // Raw Height of a Node Row, all Octaves fused over contiguous Buffers
+
+  mappool::buf<cell> generate(node& n, int x){
+
+    const int cols = tileres.y/lod;
+    thread_local std::vector<float> px, py, h;
+    px.resize(cols); py.resize(cols); h.resize(cols);
+
+    for(int y = 0; y < cols; y++){
+      vec2 p = vec2(n.pos+lod*ivec2(x, y))/vec2(quad::tileres);
+      px[y] = p.x;
+      py[y] = p.y;
+      h[y] = 0.0f;
     }
 
+    for(int o = 0; o < octaves; o++)
+    for(int y = 0; y < cols; y++)
+      h[y] += scale[o]*noise[o].GetNoise(px[y], py[y], z);
+
+    // Pool sections are reused, so every other field is cleared
+
+    cell* row = n.s.get(ivec2(x, 0));
+    std::fill(row, row + cols, cell{});
+    for(int y = 0; y < cols; y++)
+      row[y].height = h[y];
+
+    return {row, (size_t)cols};
+
+  }
+
+  void normalize(node& n, int x){
+    const int cols = tileres.y/lod;
+    cell* row = n.s.get(ivec2(x, 0));
+    for(int y = 0; y < cols; y++)
+      row[y].height = ((row[y].height - hmin)/(hmax - hmin));
+  }
+
+  // Copy a Node Row from the Cached Height Plane
+
+  void load(node& n, int x){
+    const int cols = tileres.y/lod;
+    const float* src = cached.height() + math::flatten(n.pos/lod + ivec2(x, 0), res/lod);
+    cell* row = n.s.get(ivec2(x, 0));
+    std::fill(row, row + cols, cell{});
+    for(int y = 0; y < cols; y++)
+      row[y].height = src[y];
+  }
+
+  // Materialize a Node on First Access
+  //  Threads reaching the same node wait for a single generation.
+
+  static inline bool ready(node& n){
+    return std::atomic_ref<bool>(n.generated).load(std::memory_order_acquire);
+  }
+
+  void generate(node& n){
+
+    std::lock_guard<std::mutex> guard(generating);
+    if(ready(n))
+      return;
+
+    const int rows = tileres.x/lod;
+
+    unshare(n);
+
+    parallel([&](int t, int k){
+      for(int x = t; x < rows; x += k){
+        if(cached.data != NULL)
+          load(n, x);
+        else {
+          generate(n, x);
+          normalize(n, x);
+        }
+      }
+    }, threads);
+
+    std::atomic_ref<bool>(n.generated).store(true, std::memory_order_release);
+
   }
 
   const inline bool oob(ivec2 p){
@@ -422,6 +813,8 @@ struct map {
     if(oob(p)) return NULL;
     p /= tileres;
     int ind = p.x*mapsize + p.y;
+    if(!ready(nodes[ind]))
+      generate(nodes[ind]);
     return &nodes[ind];
   }
 
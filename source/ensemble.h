@@ -0,0 +1,433 @@
+#ifndef SIMPLEHYDROLOGY_ENSEMBLE
+#define SIMPLEHYDROLOGY_ENSEMBLE
+
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <map>
+
+#include "threadpool.h"
+#include "multires.h"
+
+/*
+================================================================================
+                          Headless Ensemble Runner
+================================================================================
+  Runs many independent worlds in one process on a shared work-stealing pool.
+  Cell memory comes from one shared mappool::pool, and is returned to it when
+  a member completes, so only one section per worker is ever reserved.
+
+  A member file has one member per line, as whitespace separated key=value
+  pairs. The keys seed, steps, cycles, levels (see multires.h), lakes
+  (0 or 1, see flood.h) and fork control the run (steps is a maximum for adaptive worlds, which stop once
+  converged), every other key
+  is a World parameter (see World::param). A seed range a:b expands the line
+  into one member per seed. Empty lines and lines starting with # are skipped.
+
+    seed=1:8 steps=500 depositionRate=0.05
+    seed=1:8 steps=500 depositionRate=0.2 evapRate=0.002
+
+  Members with fork=k branch from a shared parent after k steps instead of
+  running from the start. The parent is simulated once per seed, cycles,
+  levels, lakes and k with the base parameters, and every member continues it with
+  its own, so that a parameter sweep shares its spin-up:
+
+    seed=1 steps=500 fork=200 depositionRate=0.05
+    seed=1 steps=500 fork=200 depositionRate=0.2
+
+  Every member writes its final fields to <out>/member<i>.fields, and appends
+  a line of summary metrics to <out>/summary.csv.
+*/
+
+namespace ensemble {
+
+struct member {
+  unsigned int seed = 1;
+  int steps = 100;                        // Erosion / Vegetation Steps
+  int cycles = quad::tilesize;            // Droplets per Node per Step
+  int levels = 0;                         // Multiresolution Levels (0: Base)
+  int lakes = -1;                         // Lake System, 0 or 1 (-1: Base)
+  int fork = 0;                           // Steps of the Shared Parent (0: None)
+  std::vector<std::pair<std::string, float>> params;
+};
+
+struct summary {
+  double seconds = 0.0;
+  float meanHeight = 0.0f;
+  float meanDischarge = 0.0f;
+  float wetFraction = 0.0f;               // Cells too wet for Trees
+  size_t plants = 0;
+  float residual = 0.0f;                  // Relative Discharge Change
+  int ran = 0;                            // Steps until Convergence
+};
+
+std::vector<member> parse(std::string file){
+
+  std::vector<member> members;
+  std::ifstream in(file);
+  std::string line;
+
+  while(std::getline(in, line)){
+
+    if(line.empty() || line[0] == '#')
+      continue;
+
+    member m;
+    unsigned int first = 1, last = 1;
+    bool valid = false;
+
+    std::istringstream tokens(line);
+    std::string token;
+
+    while(tokens >> token){
+
+      size_t eq = token.find('=');
+      if(eq == std::string::npos){
+        std::cout<<"ensemble: ignoring token "<<token<<std::endl;
+        continue;
+      }
+
+      std::string key = token.substr(0, eq);
+      std::string val = token.substr(eq+1);
+      valid = true;
+
+      if(key == "seed"){
+        size_t colon = val.find(':');
+        first = std::stoul(val.substr(0, colon));
+        last = (colon == std::string::npos) ? first : std::stoul(val.substr(colon+1));
+      }
+      else if(key == "steps")  m.steps = std::stoi(val);
+      else if(key == "cycles") m.cycles = std::stoi(val);
+      else if(key == "levels") m.levels = std::stoi(val);
+      else if(key == "lakes")  m.lakes = std::stoi(val);
+      else if(key == "fork")   m.fork = std::stoi(val);
+      else m.params.emplace_back(key, std::stof(val));
+
+    }
+
+    if(!valid)
+      continue;
+
+    for(unsigned int seed = first; seed <= last; seed++){
+      m.seed = seed;
+      members.push_back(m);
+    }
+
+  }
+
+  return members;
+
+}
+
+// Final Fields: Height, Discharge, Momentum X/Y, Root Density
+
+const int fields = 5;
+
+void plane(World& world, int field, std::vector<float>& plane){
+
+  plane.resize(quad::area);
+  for(auto& node: world.map.nodes)
+  for(auto [cell, pos]: node.s){
+    const float v[fields] = { cell.height, cell.discharge, cell.momentumx, cell.momentumy, cell.rootdensity };
+    plane[math::flatten(node.pos + quad::lodsize*pos, quad::res)] = (node.generated)?v[field]:0.0f;
+  }
+
+}
+
+// Field File: Header, then the Field Planes in World Order
+
+bool write(std::string path, World& world){
+
+  FILE* file = fopen(path.c_str(), "wb");
+  if(file == NULL)
+    return false;
+
+  const int32_t head[4] = { 0x46454853, quad::res.x, quad::res.y, fields }; // 'SHEF'
+  bool ok = fwrite(head, sizeof(head), 1, file) == 1;
+
+  std::vector<float> p;
+  for(int f = 0; f < fields && ok; f++){
+    plane(world, f, p);
+    ok = fwrite(&p[0], sizeof(float), p.size(), file) == p.size();
+  }
+
+  return (fclose(file) == 0) && ok;
+
+}
+
+bool read(std::string path, std::vector<float> (&planes)[fields]){
+
+  FILE* file = fopen(path.c_str(), "rb");
+  if(file == NULL)
+    return false;
+
+  int32_t head[4];
+  bool ok = fread(head, sizeof(head), 1, file) == 1;
+  ok = ok && head[0] == 0x46454853 && head[1] == quad::res.x && head[2] == quad::res.y && head[3] == fields;
+
+  for(int f = 0; f < fields && ok; f++){
+    planes[f].resize(quad::area);
+    ok = fread(&planes[f][0], sizeof(float), quad::area, file) == (size_t)quad::area;
+  }
+
+  fclose(file);
+  return ok;
+
+}
+
+summary measure(World& world){
+
+  summary s;
+  size_t count = 0;
+
+  for(auto& node: world.map.nodes){
+    if(!node.generated) continue;
+    for(auto [cell, pos]: node.s){
+      const float d = erf(0.4f*cell.discharge);
+      s.meanHeight += cell.height;
+      s.meanDischarge += d;
+      if(d >= world.plant.maxDischarge)
+        s.wetFraction += 1.0f;
+      count++;
+    }
+  }
+
+  if(count > 0){
+    s.meanHeight /= count;
+    s.meanDischarge /= count;
+    s.wetFraction /= count;
+  }
+
+  s.plants = world.vegetation.plants.size();
+  s.residual = world.residual;
+  return s;
+
+}
+
+// Member World, Configured from a Base World
+
+std::unique_ptr<World> configure(const member& m, World& base){
+
+  std::unique_ptr<World> world(new World());
+  world->configure(base);
+  world->SEED = m.seed;
+  world->threads = 1;
+  world->map.threads = 1;
+  world->levels = (m.levels > 0) ? m.levels : base.levels;
+  world->flood.enabled = (m.lakes >= 0) ? (m.lakes > 0) : base.flood.enabled;
+
+  for(auto& [key, val]: m.params)
+    *world->param(key) = val;
+
+  return world;
+
+}
+
+// Adaptive runs end early once every node has converged. Returns the steps run.
+//  A member with a parent is branched from it, and continues after its steps.
+
+int simulate(World& world, const member& m, mappool::pool<quad::cell>& cellpool, World* parent = NULL){
+
+  int step = 0;
+
+  if(parent != NULL){
+    parent->fork(world);
+    for(auto& [key, val]: m.params)
+      *world.param(key) = val;
+    step = m.fork;
+  }
+
+  else {
+    world.init(cellpool);
+    if(world.levels > 1)
+      multires::run(world);
+  }
+
+  for(; step < m.steps; step++){
+    world.erode(m.cycles);
+    world.vegetation.grow(world);
+    if(world.adaptive && world.converged())
+      return step + 1;
+  }
+
+  return m.steps;
+
+}
+
+// Shared Parents of Forked Members
+//  A parent is simulated once, before any of its members run. Members only
+//  ever read it, which is checked against a hash of its fields afterwards.
+
+struct parent {
+  member m;                               // Parent Run, without Parameters
+  std::unique_ptr<World> world;
+  std::string hash;                       // Fields at the Fork Step
+};
+
+typedef std::map<std::string, parent> parents;
+
+std::string lineage(const member& m){
+  return std::to_string(m.seed) + "/" + std::to_string(m.cycles) + "/" + std::to_string(m.levels) + "/" + std::to_string(m.lakes) + "/" + std::to_string(m.fork);
+}
+
+std::string fingerprint(World& world){
+
+  std::vector<float> all, p;
+  for(int f = 0; f < fields; f++){
+    plane(world, f, p);
+    all.insert(all.end(), p.begin(), p.end());
+  }
+
+  return cache::key(&all[0], all.size()*sizeof(float));
+
+}
+
+parents collect(const std::vector<member>& members){
+
+  parents ps;
+  for(auto& m: members){
+    if(m.fork <= 0 || ps.count(lineage(m)))
+      continue;
+    parent& p = ps[lineage(m)];
+    p.m = m;
+    p.m.steps = m.fork;
+    p.m.fork = 0;
+    p.m.params.clear();
+  }
+
+  return ps;
+
+}
+
+void prepare(parents& ps, World& base, Threadpool& pool, mappool::pool<quad::cell>& cellpool){
+
+  for(auto& entry: ps){
+    parent& p = entry.second;
+    pool.submit([&p, &base, &cellpool](){
+      p.world = configure(p.m, base);
+      simulate(*p.world, p.m, cellpool);
+      p.hash = fingerprint(*p.world);
+    });
+  }
+
+  pool.wait();
+
+}
+
+World* find(parents& ps, const member& m){
+
+  if(m.fork <= 0)
+    return NULL;
+  return ps.at(lineage(m)).world.get();
+
+}
+
+// Check that no Member has written to its Parent, then Release the Parents
+
+bool unchanged(parents& ps){
+
+  bool ok = true;
+  for(auto& [key, p]: ps){
+    if(fingerprint(*p.world) != p.hash){
+      std::cout<<"ensemble: parent "<<key<<" was changed by a fork"<<std::endl;
+      ok = false;
+    }
+    p.world->map.release();
+  }
+
+  return ok;
+
+}
+
+// Check Member Parameter Names against a World
+
+bool validate(const std::vector<member>& members, World& base){
+
+  for(auto& m: members){
+
+    for(auto& [key, val]: m.params){
+      if(base.param(key) == NULL){
+        std::cout<<"ensemble: unknown parameter "<<key<<std::endl;
+        return false;
+      }
+    }
+
+    if(m.fork < 0 || m.fork > m.steps){
+      std::cout<<"ensemble: fork step "<<m.fork<<" outside of 0 to "<<m.steps<<std::endl;
+      return false;
+    }
+
+  }
+
+  return true;
+
+}
+
+// Run all Members, Configured from a Base World
+
+bool run(std::string file, std::string out, int threads, World& base, mappool::pool<quad::cell>& cellpool){
+
+  std::vector<member> members = parse(file);
+  if(members.empty()){
+    std::cout<<"ensemble: no members in "<<file<<std::endl;
+    return false;
+  }
+
+  if(!validate(members, base))
+    return false;
+
+  mkdir(out.c_str(), 0755);
+
+  Threadpool pool(threads);
+  parents ps = collect(members);
+  cellpool.reserve((ps.size() + std::min(members.size(), (size_t)pool.size()))*quad::area);
+  prepare(ps, base, pool, cellpool);
+
+  std::ofstream csv(out + "/summary.csv");
+  csv<<"member,seed,steps,cycles,params,seconds,meanHeight,meanDischarge,wetFraction,plants,residual,ran"<<std::endl;
+  std::mutex csvlock;
+
+  std::cout<<"Running "<<members.size()<<" Members on "<<pool.size()<<" Threads"<<std::endl;
+
+  for(size_t i = 0; i < members.size(); i++)
+  pool.submit([&, i](){
+
+    PROFILE("ensemble.member");
+
+    const member& m = members[i];
+    const auto start = std::chrono::steady_clock::now();
+
+    std::unique_ptr<World> world = configure(m, base);
+
+    std::string params;
+    for(auto& [key, val]: m.params)
+      params += ((params.empty())?"":";") + key + "=" + std::to_string(val);
+
+    // Simulate, Emit the Result
+
+    const int ran = simulate(*world, m, cellpool, find(ps, m));
+
+    summary s = measure(*world);
+    s.ran = ran;
+    s.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if(!write(out + "/member" + std::to_string(i) + ".fields", *world))
+      std::cout<<"ensemble: failed to write member "<<i<<std::endl;
+
+    world->map.release();
+
+    std::lock_guard<std::mutex> guard(csvlock);
+    csv<<i<<","<<m.seed<<","<<m.steps<<","<<m.cycles<<","<<params<<","<<s.seconds<<","
+       <<s.meanHeight<<","<<s.meanDischarge<<","<<s.wetFraction<<","<<s.plants<<","<<s.residual<<","<<s.ran<<std::endl;
+    std::cout<<"Member "<<i<<" (Seed "<<m.seed<<") Done in "<<s.seconds<<"s"<<std::endl;
+
+  });
+
+  pool.wait();
+  return unchanged(ps);
+
+}
+
+}; // namespace ensemble
+
+#endif
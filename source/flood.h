@@ -0,0 +1,383 @@
+#ifndef SIMPLEHYDROLOGY_FLOOD
+#define SIMPLEHYDROLOGY_FLOOD
+
+/*
+SimpleHydrology - flood.h
+
+Defines the lake system: the water surface
+of filled depressions, lake labels and the
+incremental update of lakes after erosion.
+*/
+
+class World;
+
+struct Flood {
+
+  //Parameters
+
+  struct Param {
+    bool enabled = false;               // Maintain Lakes during Erosion
+    int period = 16;                    // Erode Calls between Full Floods
+    int margin = 4;                     // Cells Re-Flooded around a Lake
+    float minDepth = 1E-4f;             // Minimum Depth of a Lake Cell
+  };
+
+  static const int buckets = 65536;     // Height Levels of the Bucket Queue
+
+  struct Lake {
+    float level;                        // Water Surface Height
+    float spill;                        // Height of the Outlet at the Flood
+    int outlet;                         // Lowest Cell around the Lake
+    int cells;                          // Number of Lake Cells
+    ivec2 lo, hi;                       // Bounding Box (Inclusive)
+  };
+
+  // World-Sized Planes (World Order)
+
+  std::vector<float> h;                 // Terrain Height
+  std::vector<float> surface;           // Filled Surface (Strictly Draining)
+  std::vector<int> id;                  // Lake of a Cell (-1: None)
+  std::vector<Lake> lakes;
+
+  std::vector<int> head, tail, next;    // Bucket Queue, FIFO per Level
+  std::vector<uint8_t> closed;
+  float base = 0.0f, scale = 1.0f;      // Height to Bucket Level
+
+  int calls = 0;                        // Updates since the last Full Flood
+
+  // Cell at a Height is under Water
+
+  inline bool lake(ivec2 p, float height) const {
+    if(id.empty()) return false;
+    const int l = id[math::flatten(p, quad::res)];
+    return l >= 0 && lakes[l].level > height;
+  }
+
+  void fill(World& world);              // Flood the whole Map
+  void fill(const std::vector<float>& height); // Surface of a Plane, no Lakes
+  void update(World& world);            // Re-Flood Lakes whose Outlet Changed
+
+private:
+
+  void gather(World& world);
+  void levels();
+  void flood(ivec2 lo, ivec2 hi, bool whole);
+  void label(float depth);
+
+};
+
+#endif
+
+// Implementations require a complete World (see world.h)
+
+#if defined(SIMPLEHYDROLOGY_WORLD_DEFINED) && !defined(SIMPLEHYDROLOGY_FLOOD_IMPL)
+#define SIMPLEHYDROLOGY_FLOOD_IMPL
+
+/*
+================================================================================
+                         Priority-Flood Lake System
+================================================================================
+  The water surface is flooded inward from the map edge, where water leaves
+  the map (Barnes et al. 2014): the lowest open cell is closed next, and
+  raises its neighbours to at least its own surface. Surfaces increase by
+  one float step from cell to cell, so that flats and lakes keep a strictly
+  descending path to their outlet (priority-flood+epsilon).
+
+  Heights are quantized to a bucket queue with a FIFO per level, so every
+  cell is pushed and popped in O(1). Cells popped out of order within one
+  level are raised by less than a level, well below the minimum lake depth.
+
+  A lake is a connected region deeper than minDepth. Lakes keep their level,
+  bounding box and outlet. After erosion only lakes whose outlet height
+  changed are re-flooded, within their bounding box and a margin, seeded
+  from the surrounding cells. Should the lake reach the margin, or new
+  depressions have formed, the whole map is flooded again, at the latest
+  every period calls. Labels are rebuilt in one linear pass.
+*/
+
+void Flood::gather(World& world){
+
+  h.resize(quad::res.x*quad::res.y);
+
+  // Reading does not write, so shared nodes stay shared
+
+  for(auto& node: world.map.nodes)
+    if(!node.generated)
+      world.map.generate(node);
+
+  for(auto& node: world.map.nodes)
+  for(auto [cell, pos]: node.s)
+    h[math::flatten(node.pos + quad::lodsize*pos, quad::res)] = cell.height;
+
+  levels();
+
+}
+
+// Bucket Levels span the Height Range
+
+void Flood::levels(){
+
+  const int area = quad::res.x*quad::res.y;
+  surface.resize(area);
+  closed.resize(area);
+  next.resize(area);
+
+  float min = std::numeric_limits<float>::max();
+  float max = std::numeric_limits<float>::lowest();
+  for(auto& height: h){
+    min = std::min(min, height);
+    max = std::max(max, height);
+  }
+
+  base = min;
+  scale = (max > min) ? (buckets - 1)/(max - min) : 0.0f;
+
+}
+
+// Flood the Region [lo, hi] from its Border
+
+void Flood::flood(ivec2 lo, ivec2 hi, bool whole){
+
+  const ivec2 res = quad::res;
+
+  // Every flood empties the queue again
+
+  if(head.size() != buckets){
+    head.assign(buckets, -1);
+    tail.assign(buckets, -1);
+  }
+
+  static const ivec2 n[8] = {
+    ivec2( 1, 0), ivec2( 1, 1), ivec2( 0, 1), ivec2(-1, 1),
+    ivec2(-1, 0), ivec2(-1,-1), ivec2( 0,-1), ivec2( 1,-1)
+  };
+
+  int offset[8];
+  for(int k = 0; k < 8; k++)
+    offset[k] = n[k].x*res.y + n[k].y;
+
+  auto push = [&](int i){
+    const int b = glm::clamp((int)((surface[i] - base)*scale), 0, buckets - 1);
+    next[i] = -1;
+    if(tail[b] < 0) head[b] = i;
+    else next[tail[b]] = i;
+    tail[b] = i;
+  };
+
+  for(int x = lo.x; x <= hi.x; x++)
+  for(int y = lo.y; y <= hi.y; y++){
+
+    const int i = x*res.y + y;
+    closed[i] = 0;
+    if(x != lo.x && x != hi.x && y != lo.y && y != hi.y)
+      continue;
+
+    // Border cells keep the surface of their lake
+
+    surface[i] = h[i];
+    if(!whole && id[i] >= 0)
+      surface[i] = std::max(h[i], lakes[id[i]].level);
+
+    closed[i] = 1;
+    push(i);
+
+  }
+
+  for(int level = 0; level < buckets;){
+
+    const int i = head[level];
+    if(i < 0){
+      level++;
+      continue;
+    }
+
+    head[level] = next[i];
+    if(head[level] < 0)
+      tail[level] = -1;
+
+    // Cells off the region border skip the bounds checks
+
+    const ivec2 p = math::unflatten(i, res);
+    const bool inner = p.x > lo.x && p.x < hi.x && p.y > lo.y && p.y < hi.y;
+    const float raised = std::nextafter(surface[i], std::numeric_limits<float>::max());
+
+    for(int k = 0; k < 8; k++){
+
+      if(!inner){
+        const ivec2 q = p + n[k];
+        if(q.x < lo.x || q.y < lo.y || q.x > hi.x || q.y > hi.y)
+          continue;
+      }
+
+      const int j = i + offset[k];
+      if(closed[j]) continue;
+
+      closed[j] = 1;
+      surface[j] = std::max(h[j], raised);
+      push(j);
+
+    }
+
+  }
+
+}
+
+// Label Connected Lake Cells, with their Level, Bounds and Outlet
+
+void Flood::label(float depth){
+
+  const ivec2 res = quad::res;
+  const int area = res.x*res.y;
+
+  id.assign(area, -1);
+  lakes.clear();
+
+  std::vector<int> stack;
+
+  for(int s = 0; s < area; s++){
+
+    if(id[s] >= 0 || surface[s] - h[s] <= depth)
+      continue;
+
+    Lake lake = { surface[s], 0.0f, -1, 0, math::unflatten(s, res), math::unflatten(s, res) };
+    float outlet = std::numeric_limits<float>::max();
+
+    id[s] = lakes.size();
+    stack.push_back(s);
+
+    while(!stack.empty()){
+
+      const int i = stack.back();
+      stack.pop_back();
+
+      const ivec2 p = math::unflatten(i, res);
+      lake.cells++;
+      lake.level = std::max(lake.level, surface[i]);
+      lake.lo = glm::min(lake.lo, p);
+      lake.hi = glm::max(lake.hi, p);
+
+      for(int dx = -1; dx <= 1; dx++)
+      for(int dy = -1; dy <= 1; dy++){
+
+        const ivec2 q = p + ivec2(dx, dy);
+        if(q.x < 0 || q.y < 0 || q.x >= res.x || q.y >= res.y)
+          continue;
+
+        const int j = q.x*res.y + q.y;
+        if(id[j] >= 0)
+          continue;
+
+        if(surface[j] - h[j] > depth){
+          id[j] = lakes.size();
+          stack.push_back(j);
+        }
+        else if(h[j] < outlet){
+          outlet = h[j];
+          lake.outlet = j;
+        }
+
+      }
+
+    }
+
+    lake.spill = outlet;
+    lakes.push_back(lake);
+
+  }
+
+}
+
+void Flood::fill(World& world){
+
+  PROFILE("flood.fill");
+
+  gather(world);
+  flood(ivec2(0), quad::res - 1, true);
+  label(world.flood.minDepth);
+  calls = 0;
+
+}
+
+void Flood::fill(const std::vector<float>& height){
+
+  h = height;
+  levels();
+  flood(ivec2(0), quad::res - 1, true);
+
+}
+
+void Flood::update(World& world){
+
+  if(id.empty()){
+    fill(world);
+    return;
+  }
+
+  if(++calls >= world.flood.period){
+    fill(world);
+    return;
+  }
+
+  PROFILE("flood.update");
+
+  const Param& param = world.flood;
+  const ivec2 res = quad::res;
+
+  gather(world);
+
+  // Stale surfaces: lakes keep their level, other cells follow the terrain
+
+  for(int i = 0; i < res.x*res.y; i++)
+    surface[i] = (id[i] >= 0) ? std::max(h[i], lakes[id[i]].level) : h[i];
+
+  // A lake next to the border of the region, where it does not lie on the
+  // map edge, may extend beyond it. Other lakes keep their level.
+
+  auto spills = [&](ivec2 lo, ivec2 hi, int l){
+    for(int x = lo.x + 1; x < hi.x; x++)
+    for(int y = lo.y + 1; y < hi.y; y++){
+      const bool border = (x == lo.x + 1 && lo.x > 0) || (x == hi.x - 1 && hi.x < res.x - 1)
+                       || (y == lo.y + 1 && lo.y > 0) || (y == hi.y - 1 && hi.y < res.y - 1);
+      if(!border) continue;
+      const int i = x*res.y + y;
+      const bool other = id[i] >= 0 && id[i] != l && surface[i] <= lakes[id[i]].level + param.minDepth;
+      if(!other && surface[i] - h[i] > param.minDepth)
+        return true;
+    }
+    return false;
+  };
+
+  // Regions grow until the lake fits, within a quarter of the map in total
+
+  size_t reflooded = 0;
+  for(size_t l = 0; l < lakes.size(); l++){
+
+    const Lake& lake = lakes[l];
+    if(lake.outlet < 0 || std::abs(h[lake.outlet] - lake.spill) <= param.minDepth)
+      continue;
+
+    for(int margin = param.margin;; margin *= 2){
+
+      const ivec2 lo = glm::max(lake.lo - margin, ivec2(0));
+      const ivec2 hi = glm::min(lake.hi + margin, res - 1);
+
+      reflooded += (hi.x - lo.x + 1)*(hi.y - lo.y + 1);
+      if(reflooded > (size_t)(res.x*res.y)/4){
+        fill(world);
+        return;
+      }
+
+      flood(lo, hi, false);
+      if(!spills(lo, hi, l))
+        break;
+
+    }
+
+  }
+
+  if(reflooded > 0)
+    label(param.minDepth);
+
+}
+
+#endif
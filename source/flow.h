@@ -0,0 +1,375 @@
+#ifndef SIMPLEHYDROLOGY_FLOW
+#define SIMPLEHYDROLOGY_FLOW
+
+#include <cassert>
+
+/*
+SimpleHydrology - flow.h
+
+Defines a flow routing estimate of the
+discharge and momentum maps, computed in
+a single pass over the terrain.
+*/
+
+class World;
+
+struct Flow {
+
+  //Parameters
+
+  struct Param {
+    bool seed = false;                  // Route once after World::init
+    bool dinf = false;                  // D-Infinity (else D8) Receivers
+    bool momentum = true;               // Write the Flow Direction as Momentum
+    float volume = 1.0f/quad::tilesize; // Discharge per Upstream Cell
+  };
+
+  // World-Sized Planes (World Order)
+
+  std::vector<float> h;                 // Terrain Height
+  std::vector<float> a;                 // Accumulated Upstream Area
+  std::vector<int> receiver[2];         // Downstream Cells (-1: None)
+  std::vector<float> weight;            // Fraction to the first Receiver
+  std::vector<int> donors;              // Unresolved Upstream Cells
+  std::vector<int> order;               // Topological Order, Upstream First
+  std::vector<int> outlets;             // Cells without a Receiver
+
+  void route(World& world);
+
+  // Stages of a Route, over any World-Sized Height Plane
+
+  void receivers(const std::vector<float>& height, bool dinf, int threads);
+  void accumulate(const std::vector<float>& rain);
+  template<typename F>                  // Per Basin, D8 only (see below)
+  void basins(const std::vector<float>& rain, int threads, F&& visit);
+  void scatter(World& world);
+
+};
+
+#endif
+
+// Implementations require a complete World (see world.h)
+
+#if defined(SIMPLEHYDROLOGY_WORLD_DEFINED) && !defined(SIMPLEHYDROLOGY_FLOW_IMPL)
+#define SIMPLEHYDROLOGY_FLOW_IMPL
+
+/*
+================================================================================
+                          Flow Routing Accumulation
+================================================================================
+  Every cell passes its water to its steepest-descent neighbours:
+
+    D8:         the single neighbour of the eight with the steepest drop
+    D-Infinity: the steepest direction over the eight triangular facets
+                (Tarboton 1997), split between the two neighbours spanning
+                the facet in proportion to its angle
+
+  Receivers are strictly lower, so the receiver graph is acyclic. Cells
+  without donors are ordered first, and a cell follows once all of its
+  donors are ordered (Kahn), so a single linear pass accumulates the
+  upstream area of every cell. Pits and flats have no receiver and keep
+  their water, unless lakes are enabled: the filled surface drains every
+  cell to the map edge.
+
+  The area, weighted by the rainfall map, scales to the discharge of the
+  droplets that would cross a cell per erosion step. The estimate is written
+  to both the discharge average and the tracking maps, so that it is at
+  once converged under the average.
+*/
+
+void Flow::route(World& world){
+
+  h.resize(quad::res.x*quad::res.y);
+
+  // Gather Terrain, the whole Map is Routed
+
+  for(auto& node: world.map.nodes){
+    if(!node.generated)
+      world.map.generate(node);
+    world.map.unshare(node);
+  }
+
+  for(auto& node: world.map.nodes)
+  for(auto [cell, pos]: node.s)
+    h[math::flatten(node.pos + quad::lodsize*pos, quad::res)] = cell.height;
+
+  // With lakes, water is routed over the filled surface through them
+
+  if(world.flood.enabled){
+    world.lakes.fill(world);
+    h = world.lakes.surface;
+  }
+
+  receivers(h, world.flow.dinf, world.threads);
+  accumulate(world.rain);
+  scatter(world);
+
+}
+
+void Flow::receivers(const std::vector<float>& h, bool dinf, int threads){
+
+  const ivec2 res = quad::res;
+  const int area = res.x*res.y;
+
+  receiver[0].resize(area); receiver[1].resize(area);
+  weight.resize(area);
+
+  // Receivers, in Parallel Rows
+  //  Neighbours in counter-clockwise order, cardinal on even indices,
+  //  so that facet k spans neighbours k and k+1.
+
+  static const ivec2 n[8] = {
+    ivec2( 1, 0), ivec2( 1, 1), ivec2( 0, 1), ivec2(-1, 1),
+    ivec2(-1, 0), ivec2(-1,-1), ivec2( 0,-1), ivec2( 1,-1)
+  };
+
+  int offset[8];
+  for(int k = 0; k < 8; k++)
+    offset[k] = n[k].x*res.y + n[k].y;
+
+  const float quarter = 0.25f*3.14159265f;
+
+  quad::parallel([&](int thread, int nthreads){
+    for(int x = thread; x < res.x; x += nthreads)
+    for(int y = 0; y < res.y; y++){
+
+      const ivec2 p = ivec2(x, y);
+      const int i = x*res.y + y;
+
+      const bool inner = x > 0 && y > 0 && x < res.x - 1 && y < res.y - 1;
+
+      int k = -1;
+      float steepest = 0.0f, fraction = 1.0f;
+
+      if(!dinf)
+      for(int j = 0; j < 8; j++){
+        if(!inner){
+          const ivec2 q = p + n[j];
+          if(q.x < 0 || q.y < 0 || q.x >= res.x || q.y >= res.y)
+            continue;
+        }
+        const float s = (h[i] - h[i + offset[j]])*((j % 2) ? 0.70710678f : 1.0f);
+        if(s > steepest){
+          steepest = s;
+          k = j;
+        }
+      }
+
+      else
+      for(int j = 0; j < 8; j++){
+
+        // Facet between the cardinal and diagonal neighbour, either order
+
+        const int c = (j % 2) ? j + 1 : j;
+        const int d = (j % 2) ? j : j + 1;
+        const ivec2 qc = p + n[c % 8];
+        const ivec2 qd = p + n[d % 8];
+        if(qc.x < 0 || qc.y < 0 || qc.x >= res.x || qc.y >= res.y) continue;
+        if(qd.x < 0 || qd.y < 0 || qd.x >= res.x || qd.y >= res.y) continue;
+
+        const float hc = h[math::flatten(qc, res)];
+        const float hd = h[math::flatten(qd, res)];
+        const float s1 = h[i] - hc;
+        const float s2 = hc - hd;
+
+        float r = atan2(s2, s1), s = sqrt(s1*s1 + s2*s2);
+        if(r < 0.0f){
+          r = 0.0f;
+          s = s1;
+        }
+        if(r > quarter){
+          r = quarter;
+          s = (h[i] - hd)/1.41421356f;
+        }
+
+        if(s > steepest){
+          steepest = s;
+          k = j;
+          fraction = 1.0f - r/quarter;
+        }
+
+      }
+
+      receiver[0][i] = receiver[1][i] = -1;
+      weight[i] = 1.0f;
+
+      if(k < 0)
+        continue;
+
+      if(!dinf){
+        receiver[0][i] = math::flatten(p + n[k], res);
+        continue;
+      }
+
+      // Edges only to lower Neighbours with Flow: a facet clamped to its
+      // diagonal drains to it alone, its cardinal neighbour may be higher
+
+      const int c = (k % 2) ? k + 1 : k;
+      const int d = (k % 2) ? k : k + 1;
+
+      if(fraction <= 0.0f){
+        receiver[0][i] = math::flatten(p + n[d % 8], res);
+        continue;
+      }
+
+      receiver[0][i] = math::flatten(p + n[c % 8], res);
+      receiver[1][i] = (fraction < 1.0f) ? math::flatten(p + n[d % 8], res) : -1;
+      weight[i] = fraction;
+
+    }
+  }, threads);
+
+}
+
+// Topological Order, Accumulation
+
+void Flow::accumulate(const std::vector<float>& rain){
+
+  const int area = quad::res.x*quad::res.y;
+
+  a.resize(area);
+  donors.resize(area);
+  order.clear();
+  order.reserve(area);
+
+  std::fill(donors.begin(), donors.end(), 0);
+  for(int i = 0; i < area; i++)
+  for(auto& r: receiver)
+    if(r[i] >= 0) donors[r[i]]++;
+
+  const bool weighted = !rain.empty();
+  for(int i = 0; i < area; i++){
+    a[i] = (weighted) ? rain[i] : 1.0f;
+    if(donors[i] == 0)
+      order.push_back(i);
+  }
+
+  for(size_t o = 0; o < order.size(); o++){
+    const int i = order[o];
+    for(int k = 0; k < 2; k++){
+      const int r = receiver[k][i];
+      if(r < 0) continue;
+      a[r] += ((k == 0) ? weight[i] : 1.0f - weight[i])*a[i];
+      if(--donors[r] == 0)
+        order.push_back(r);
+    }
+  }
+
+  // Every Cell is Ordered, unless the Receivers had a Cycle
+
+  assert(order.size() == (size_t)area);
+
+}
+
+// Scatter Discharge and Momentum
+
+// Per-Basin Order and Accumulation, for single (D8) Receivers
+//  Every cell without a receiver is the outlet of a tree of donors, and no
+//  two trees share a cell, so basins are ordered and accumulated on parallel
+//  threads. The donors of a cell are the neighbours whose receiver it is.
+//  Every basin is then passed to visit, in order from its outlet upstream.
+
+template<typename F>
+void Flow::basins(const std::vector<float>& rain, int threads, F&& visit){
+
+  const ivec2 res = quad::res;
+  const int area = res.x*res.y;
+
+  a.resize(area);
+
+  outlets.clear();
+  for(int i = 0; i < area; i++)
+    if(receiver[0][i] < 0)
+      outlets.push_back(i);
+
+  static const ivec2 n[8] = {
+    ivec2( 1, 0), ivec2( 1, 1), ivec2( 0, 1), ivec2(-1, 1),
+    ivec2(-1, 0), ivec2(-1,-1), ivec2( 0,-1), ivec2( 1,-1)
+  };
+
+  int offset[8];
+  for(int k = 0; k < 8; k++)
+    offset[k] = n[k].x*res.y + n[k].y;
+
+  const bool weighted = !rain.empty();
+  std::atomic<size_t> next{0};
+
+  quad::parallel([&](int, int){
+
+    std::vector<int> stack, basin;
+
+    while(true){
+
+      const size_t b = next.fetch_add(1, std::memory_order_relaxed);
+      if(b >= outlets.size()) break;
+
+      basin.clear();
+      stack.push_back(outlets[b]);
+
+      while(!stack.empty()){
+
+        const int i = stack.back();
+        stack.pop_back();
+        basin.push_back(i);
+        a[i] = (weighted) ? rain[i] : 1.0f;
+
+        const ivec2 p = math::unflatten(i, res);
+        const bool inner = p.x > 0 && p.y > 0 && p.x < res.x - 1 && p.y < res.y - 1;
+
+        for(int k = 0; k < 8; k++){
+          if(!inner){
+            const ivec2 q = p + n[k];
+            if(q.x < 0 || q.y < 0 || q.x >= res.x || q.y >= res.y)
+              continue;
+          }
+          if(receiver[0][i + offset[k]] == i)
+            stack.push_back(i + offset[k]);
+        }
+
+      }
+
+      for(auto o = basin.rbegin(); o != basin.rend(); o++){
+        const int r = receiver[0][*o];
+        if(r >= 0) a[r] += a[*o];
+      }
+
+      visit(basin);
+
+    }
+
+  }, threads);
+
+}
+
+void Flow::scatter(World& world){
+
+  const Param& param = world.flow;
+  const ivec2 res = quad::res;
+
+  for(auto& node: world.map.nodes)
+  for(auto [cell, pos]: node.s){
+
+    const ivec2 p = node.pos + quad::lodsize*pos;
+    const int i = math::flatten(p, res);
+    const float discharge = param.volume*a[i];
+
+    cell.discharge = cell.discharge_track = discharge;
+    if(!param.momentum)
+      continue;
+
+    vec2 dir = vec2(0.0f);
+    for(int k = 0; k < 2; k++){
+      const int r = receiver[k][i];
+      if(r < 0) continue;
+      const vec2 step = vec2(math::unflatten(r, res) - p);
+      dir += ((k == 0) ? weight[i] : 1.0f - weight[i])*step/length(step);
+    }
+
+    cell.momentumx = cell.momentumx_track = discharge*dir.x;
+    cell.momentumy = cell.momentumy_track = discharge*dir.y;
+
+  }
+
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef SIMPLEHYDROLOGY_MULTIRES
+#define SIMPLEHYDROLOGY_MULTIRES
+
+/*
+================================================================================
+                      Coarse-to-Fine Multiresolution Erosion
+================================================================================
+  Droplets at a coarse cell size cross the map in fewer steps, so the large
+  scale drainage structure forms with a fraction of the full resolution
+  work. Starting from the coarsest level of the pyramid:
+
+    coarsen:    a coarse World averages the finer map over lod x lod blocks
+    erode:      droplets run on the coarse World for a number of steps
+    upsample:   the change in height is interpolated bilinearly and added
+                to the finer map, whose detail is kept; the coarse discharge
+                and momentum replace the finer ones as a converged seed
+
+  Each level halves the cell size down to the map's own, on which the
+  selected engine then continues. Coarse Worlds only run droplets, and
+  allocate their cells from the heap.
+*/
+
+namespace multires {
+
+// World-Order Plane of a Map at its Cell Size
+
+std::vector<float> plane(quad::map& map, float quad::cell::*field){
+
+  const ivec2 res = quad::res/map.lod;
+  std::vector<float> p(res.x*res.y);
+
+  for(auto& node: map.nodes)
+  for(auto [cell, pos]: node.s)
+    p[math::flatten(node.pos/map.lod + pos, res)] = cell.*field;
+
+  return p;
+
+}
+
+// Bilinear Sample of a Plane at a World Position, Values at Cell Centers
+
+float sample(const std::vector<float>& p, ivec2 res, int lod, vec2 pos){
+
+  const vec2 u = glm::clamp(pos/(float)lod - 0.5f, vec2(0.0f), vec2(res - 1));
+  const ivec2 a = glm::min(ivec2(u), res - 2);
+  const vec2 f = u - vec2(a);
+
+  const int i = math::flatten(a, res);
+  return (1.0f-f.x)*((1.0f-f.y)*p[i] + f.y*p[i + 1])
+       + f.x*((1.0f-f.y)*p[i + res.y] + f.y*p[i + res.y + 1]);
+
+}
+
+void run(World& world){
+
+  PROFILE("multires");
+
+  for(int level = world.levels - 1; level > 0; level--){
+
+    const int lod = world.map.lod << level;
+    const ivec2 res = quad::res/lod;
+
+    std::cout<<"... eroding at cell size "<<lod<<" ..."<<std::endl;
+
+    // Coarse World with the Parameters of the Fine One
+    //  Coarse levels run plain droplets, without lakes or a schedule.
+
+    World coarse;
+    coarse.SEED = world.SEED;
+    coarse.rng.seed(world.rng());
+    coarse.configure(world);
+    coarse.engine = World::Droplets;
+    coarse.flood.enabled = false;
+    coarse.adaptive = false;
+    coarse.levels = 1;
+
+    coarse.map.coarsen(world.map, lod);
+    const std::vector<float> before = plane(coarse.map, &quad::cell::height);
+
+    for(int step = 0; step < world.coarsesteps; step++)
+      coarse.erode(quad::tilesize);
+
+    // Upsample the Change in Height, Seed Discharge and Momentum
+
+    std::vector<float> delta = plane(coarse.map, &quad::cell::height);
+    for(size_t i = 0; i < delta.size(); i++)
+      delta[i] -= before[i];
+
+    const std::vector<float> discharge = plane(coarse.map, &quad::cell::discharge);
+    const std::vector<float> momentumx = plane(coarse.map, &quad::cell::momentumx);
+    const std::vector<float> momentumy = plane(coarse.map, &quad::cell::momentumy);
+
+    for(auto& node: world.map.nodes){
+      world.map.unshare(node);
+      for(auto [cell, pos]: node.s){
+        const vec2 p = vec2(node.pos + world.map.lod*pos) + 0.5f*world.map.lod;
+        cell.height += sample(delta, res, lod, p);
+        cell.discharge = sample(discharge, res, lod, p);
+        cell.momentumx = sample(momentumx, res, lod, p);
+        cell.momentumy = sample(momentumy, res, lod, p);
+      }
+    }
+
+  }
+
+  // Spawn Tables were built on the old Heights
+
+  for(auto& spawner: world.spawners)
+    spawner.built = false;
+
+}
+
+}; // namespace multires
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef SIMPLEHYDROLOGY_PIPE
+#define SIMPLEHYDROLOGY_PIPE
+
+/*
+SimpleHydrology - pipe.h
+
+Defines a grid-based alternative to the
+droplet model: a virtual pipe shallow
+water solver with sediment transport.
+*/
+
+class World;
+
+struct Pipe {
+
+  //Parameters
+
+  struct Param {
+    int iterations = 8;                 // Solver Steps per Erosion Step
+    float dt = 0.05f;                   // Solver Time Step
+    float rain = 0.01f;                 // Rainfall Depth per Unit Time
+    float gravity = 9.81f;              // Gravity Acceleration
+    float pipe = 1.0f;                  // Pipe Cross Section / Length
+    float capacity = 1.0f;              // Sediment Capacity Constant
+    float erosion = 0.1f;               // Terrain Dissolving Rate
+    float deposition = 0.1f;            // Sediment Deposition Rate
+    float evaporation = 0.05f;          // Water Evaporation Rate
+    float minTilt = 0.05f;              // Minimum Slope for the Capacity
+    float discharge = 10.0f;            // Outflow Scale of the Discharge Map
+  };
+
+  // World-Sized Planes (World Order)
+
+  std::vector<float> b;                 // Terrain Height (Scaled by mapscale)
+  std::vector<float> r;                 // Root Density
+  std::vector<float> w;                 // Water Depth
+  std::vector<float> f[4];              // Outflow Flux: -X, +X, -Y, +Y
+  std::vector<float> s;                 // Suspended Sediment
+  std::vector<float> t;                 // Sediment Scratch / Slope Plane
+  std::vector<float> u, v;              // Water Velocity
+  std::vector<float> q;                 // Accumulated Outflow
+
+  void erode(World& world);
+
+};
+
+#endif
+
+// Implementations require a complete World (see world.h)
+
+#if defined(SIMPLEHYDROLOGY_WORLD_DEFINED) && !defined(SIMPLEHYDROLOGY_PIPE_IMPL)
+#define SIMPLEHYDROLOGY_PIPE_IMPL
+
+/*
+================================================================================
+                     Virtual Pipe Shallow Water Erosion
+================================================================================
+  Water columns on the grid are connected to their four neighbours by
+  virtual pipes (Mei et al. 2007). Every solver step:
+
+    flux:       pipe outflows accelerate with the surface height difference,
+                and are scaled down so that no column drains below zero
+    water:      depths change by the net flux and rain, velocities follow
+                from the flux through each cell
+    erosion:    the sediment capacity grows with slope and speed; below it,
+                terrain dissolves (reduced by root density), above it,
+                sediment is deposited
+    transport:  sediment is advected semi-Lagrangian, water evaporates and
+                drains at the map edges
+
+  Each pass reads neighbours only from planes it does not write, so rows
+  are updated on parallel threads. The mean outflow and water momentum of
+  an erosion step feed the same tracking maps as the droplets.
+*/
+
+void Pipe::erode(World& world){
+
+  const Param& param = world.pipe;
+  const ivec2 res = quad::res;
+  const int area = res.x*res.y;
+
+  if(w.size() != (size_t)area){
+    b.assign(area, 0.0f); r.assign(area, 0.0f);
+    w.assign(area, 0.0f); s.assign(area, 0.0f); t.assign(area, 0.0f);
+    u.assign(area, 0.0f); v.assign(area, 0.0f); q.assign(area, 0.0f);
+    for(auto& plane: f) plane.assign(area, 0.0f);
+  }
+
+  // Parallel Rows
+
+  auto rows = [&](auto&& kernel){
+    quad::parallel([&](int thread, int n){
+      for(int x = thread; x < res.x; x += n)
+        kernel(x);
+    }, world.threads);
+  };
+
+  // Gather Terrain, the whole Map is Simulated
+
+  for(auto& node: world.map.nodes){
+    if(!node.generated)
+      world.map.generate(node);
+    world.map.unshare(node);
+  }
+
+  for(auto& node: world.map.nodes)
+  for(auto [cell, pos]: node.s){
+    const int i = math::flatten(node.pos + quad::lodsize*pos, res);
+    b[i] = quad::mapscale*cell.height;
+    r[i] = cell.rootdensity;
+    q[i] = 0.0f;
+  }
+
+  const float dt = param.dt;
+  const bool weighted = !world.rain.empty();
+
+  for(int it = 0; it < param.iterations; it++){
+
+    // Outflow Flux, Slope
+
+    rows([&](int x){
+      for(int y = 0; y < res.y; y++){
+
+        const int i = x*res.y + y;
+        const float H = b[i] + w[i];
+        const int n[4] = { i - res.y, i + res.y, i - 1, i + 1 };
+        const bool in[4] = { x > 0, x < res.x - 1, y > 0, y < res.y - 1 };
+
+        float sum = 0.0f;
+        for(int k = 0; k < 4; k++){
+          f[k][i] = in[k] ? std::max(0.0f, f[k][i] + dt*param.gravity*param.pipe*(H - b[n[k]] - w[n[k]])) : 0.0f;
+          sum += f[k][i];
+        }
+
+        if(sum > 0.0f){
+          const float K = std::min(1.0f, w[i]/(sum*dt));
+          for(int k = 0; k < 4; k++)
+            f[k][i] *= K;
+        }
+
+        const float gx = 0.5f*(b[in[1]?n[1]:i] - b[in[0]?n[0]:i]);
+        const float gy = 0.5f*(b[in[3]?n[3]:i] - b[in[2]?n[2]:i]);
+        const float g2 = gx*gx + gy*gy;
+        t[i] = std::max(param.minTilt, sqrt(g2/(1.0f + g2)));
+
+      }
+    });
+
+    // Water Depth, Velocity, Rain
+
+    rows([&](int x){
+      for(int y = 0; y < res.y; y++){
+
+        const int i = x*res.y + y;
+        const float fxl = (x > 0)         ? f[1][i - res.y] : 0.0f;   // Inflow from -X
+        const float fxr = (x < res.x - 1) ? f[0][i + res.y] : 0.0f;   // Inflow from +X
+        const float fyl = (y > 0)         ? f[3][i - 1] : 0.0f;
+        const float fyr = (y < res.y - 1) ? f[2][i + 1] : 0.0f;
+
+        const float out = f[0][i] + f[1][i] + f[2][i] + f[3][i];
+        const float depth = w[i];
+        w[i] = std::max(0.0f, depth + dt*(fxl + fxr + fyl + fyr - out));
+        w[i] += dt*param.rain*((weighted) ? world.rain[i] : 1.0f);
+        q[i] += out;
+
+        const float mean = 0.5f*(depth + w[i]);
+        const float limit = 1.0f/dt;        // At most one Cell per Step
+        if(mean > 1E-4f){
+          u[i] = glm::clamp(0.5f*(fxl - f[0][i] + f[1][i] - fxr)/mean, -limit, limit);
+          v[i] = glm::clamp(0.5f*(fyl - f[2][i] + f[3][i] - fyr)/mean, -limit, limit);
+        }
+        else u[i] = v[i] = 0.0f;
+
+      }
+    });
+
+    // Erosion, Deposition
+
+    rows([&](int x){
+      for(int y = 0; y < res.y; y++){
+
+        const int i = x*res.y + y;
+        const float C = param.capacity*t[i]*sqrt(u[i]*u[i] + v[i]*v[i]);
+
+        if(C > s[i]){
+          const float d = dt*param.erosion*std::max(0.0f, 1.0f - r[i])*(C - s[i]);
+          b[i] -= d;
+          s[i] += d;
+        }
+        else {
+          const float d = dt*param.deposition*(s[i] - C);
+          b[i] += d;
+          s[i] -= d;
+        }
+
+      }
+    });
+
+    // Semi-Lagrangian Sediment Transport, Evaporation, Drains
+
+    rows([&](int x){
+      for(int y = 0; y < res.y; y++){
+
+        const int i = x*res.y + y;
+
+        const float px = glm::clamp(x - u[i]*dt, 0.0f, res.x - 1.0f);
+        const float py = glm::clamp(y - v[i]*dt, 0.0f, res.y - 1.0f);
+        const int x0 = std::min((int)px, res.x - 2);
+        const int y0 = std::min((int)py, res.y - 2);
+        const float ax = px - x0, ay = py - y0;
+        const int j = x0*res.y + y0;
+
+        t[i] = (1.0f-ax)*((1.0f-ay)*s[j] + ay*s[j + 1])
+             + ax*((1.0f-ay)*s[j + res.y] + ay*s[j + res.y + 1]);
+
+        w[i] *= (1.0f - param.evaporation*dt);
+
+        if(x == 0 || y == 0 || x == res.x - 1 || y == res.y - 1)
+          w[i] = t[i] = 0.0f;
+
+      }
+    });
+
+    std::swap(s, t);
+
+  }
+
+  // Scatter Terrain and Tracking Maps
+
+  const float scale = param.discharge/param.iterations;
+
+  for(auto& node: world.map.nodes)
+  for(auto [cell, pos]: node.s){
+    const int i = math::flatten(node.pos + quad::lodsize*pos, res);
+    cell.height = b[i]/quad::mapscale;
+    cell.discharge_track += scale*q[i];
+    cell.momentumx_track += param.discharge*w[i]*u[i];
+    cell.momentumy_track += param.discharge*w[i]*v[i];
+  }
+
+}
+
+#endif
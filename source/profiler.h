@@ -0,0 +1,167 @@
+#ifndef SIMPLEHYDROLOGY_PROFILER
+#define SIMPLEHYDROLOGY_PROFILER
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <fstream>
+
+/*
+================================================================================
+                          Scoped Phase Profiler
+================================================================================
+  Timing zones are recorded per thread into fixed-size ring buffers, with a
+  single release-store per zone and no locks on the hot path. The rings are
+  dumped as Chrome / Perfetto trace event JSON (chrome://tracing, ui.perfetto.dev).
+
+  Zones compile to nothing unless SIMPLEHYDROLOGY_PROFILE is defined:
+
+    -DSIMPLEHYDROLOGY_PROFILE       phase zones (erosion, vegetation, rendering)
+    -DSIMPLEHYDROLOGY_PROFILE=2     additionally per-droplet and cascade zones
+
+  Rings keep only the newest ringsize zones of every thread. A thread
+  returns its ring on exit, and the next new thread continues it, so that
+  thread pools re-created per call do not allocate a ring each.
+*/
+
+namespace profiler {
+
+struct event {
+  const char* name;
+  uint64_t start;                     // Nanoseconds since Profiler Epoch
+  uint64_t end;
+};
+
+const size_t ringsize = 1 << 16;
+
+struct ring {
+  event events[ringsize];
+  std::atomic<uint64_t> head{0};      // Number of Recorded Events
+  uint32_t tid = 0;
+};
+
+struct registry {
+  std::mutex lock;
+  std::vector<std::unique_ptr<ring>> rings;
+  std::vector<ring*> free;            // Rings of Exited Threads
+};
+
+inline registry& rings(){
+  static registry r;
+  return r;
+}
+
+inline uint64_t now(){
+  static const auto epoch = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+// Thread-Local Ring, Taken on First Use and Returned on Exit
+
+struct owner {
+  ring* r = NULL;
+  ~owner(){
+    if(r == NULL) return;
+    registry& reg = rings();
+    std::lock_guard<std::mutex> guard(reg.lock);
+    reg.free.push_back(r);
+  }
+};
+
+inline ring& local(){
+
+  thread_local owner o;
+
+  if(o.r == NULL){
+    registry& reg = rings();
+    std::lock_guard<std::mutex> guard(reg.lock);
+    if(!reg.free.empty()){
+      o.r = reg.free.back();
+      reg.free.pop_back();
+    }
+    else {
+      reg.rings.emplace_back(new ring());
+      o.r = reg.rings.back().get();
+      o.r->tid = reg.rings.size();
+    }
+  }
+
+  return *o.r;
+
+}
+
+inline void record(const char* name, uint64_t start, uint64_t end){
+  ring& r = local();
+  const uint64_t h = r.head.load(std::memory_order_relaxed);
+  r.events[h%ringsize] = {name, start, end};
+  r.head.store(h + 1, std::memory_order_release);
+}
+
+struct zone {
+  const char* name;
+  uint64_t start;
+  zone(const char* _name):name(_name),start(now()){}
+  ~zone(){ record(name, start, now()); }
+};
+
+// Export all Rings as Trace Event JSON
+
+bool dump(std::string path){
+
+  std::ofstream out(path);
+  if(!out.is_open())
+    return false;
+
+  out<<"{\"traceEvents\":[";
+  bool first = true;
+
+  registry& reg = rings();
+  std::lock_guard<std::mutex> guard(reg.lock);
+
+  for(auto& r: reg.rings){
+
+    const uint64_t head = r->head.load(std::memory_order_acquire);
+    const uint64_t tail = (head > ringsize) ? head - ringsize : 0;
+
+    std::vector<event> events;
+    for(uint64_t i = tail; i < head; i++)
+      events.push_back(r->events[i%ringsize]);
+
+    // Drop Events the Owner may have Overwritten while Copying
+
+    const uint64_t after = r->head.load(std::memory_order_acquire);
+    const uint64_t valid = (after > ringsize) ? after - ringsize : 0;
+
+    for(uint64_t i = std::max(tail, valid); i < head; i++){
+      const event& e = events[i - tail];
+      out<<((first)?"":",")<<"\n{\"name\":\""<<e.name<<"\",\"ph\":\"X\",\"pid\":0,\"tid\":"<<r->tid
+         <<",\"ts\":"<<(double)e.start/1000.0<<",\"dur\":"<<(double)(e.end - e.start)/1000.0<<"}";
+      first = false;
+    }
+
+  }
+
+  out<<"\n]}"<<std::endl;
+  return true;
+
+}
+
+}; // namespace profiler
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#if defined(SIMPLEHYDROLOGY_PROFILE)
+#define PROFILE(name) profiler::zone PROFILE_CONCAT(_profile_zone, __LINE__)(name)
+#else
+#define PROFILE(name)
+#endif
+
+#if defined(SIMPLEHYDROLOGY_PROFILE) && (SIMPLEHYDROLOGY_PROFILE + 0) >= 2
+#define PROFILE_FINE(name) profiler::zone PROFILE_CONCAT(_profile_zone, __LINE__)(name)
+#else
+#define PROFILE_FINE(name)
+#endif
+
+#endif
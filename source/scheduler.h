@@ -0,0 +1,92 @@
+#ifndef SIMPLEHYDROLOGY_SCHEDULER
+#define SIMPLEHYDROLOGY_SCHEDULER
+
+#include <chrono>
+
+/*
+================================================================================
+                        Frame Time Budgeted Scheduler
+================================================================================
+  Sizes the simulation work of every viewer frame to a target frame time.
+
+  A simulation step (one erode call and one vegetation tick) is the unit of
+  work, since the discharge average depends on the droplets per call. The
+  cost of a step is predicted from the smoothed cost per droplet and per
+  plant. Every frame, the time left after rendering buys a fraction of a
+  step, and fractions carry over: a slow machine steps every few frames and
+  stays responsive, a fast one runs several steps per frame.
+*/
+
+struct Scheduler {
+
+  typedef std::chrono::steady_clock clock;
+
+  float target = 1.0f/30.0f;              // Target Frame Time [s] (0: Fixed)
+  int maxsteps = 8;                       // Maximum Steps per Frame
+  float smoothing = 0.2f;                 // Weight of the Latest Measurement
+
+  double droplet = 0.0;                   // Seconds per Droplet
+  double plant = 0.0;                     // Seconds per Plant
+  double other = 0.0;                     // Non-Simulation Seconds per Frame
+  double credit = 0.0;                    // Carried Fraction of a Step
+  double simulated = 0.0;                 // Simulation Seconds this Frame
+
+  clock::time_point last;                 // Start of the last Frame (Unset: None)
+
+  void measure(double& metric, double value){
+    metric = (metric == 0.0) ? value : (1.0 - smoothing)*metric + smoothing*value;
+  }
+
+  // Steps to run this Frame, given the Work of the next Step
+
+  int plan(size_t droplets, size_t plants){
+
+    const clock::time_point now = clock::now();
+    const double frame = (last == clock::time_point()) ? 1.0 : std::chrono::duration<double>(now - last).count();
+    last = now;
+
+    if(frame < 1.0)                       // Skip the First Frame and Pauses
+      measure(other, std::max(frame - simulated, 1E-6));
+    simulated = 0.0;
+
+    if(target <= 0.0f)
+      return 1;
+
+    const double cost = droplets*droplet + std::max(plants, (size_t)1)*plant;
+    if(cost <= 0.0)                       // Unmeasured: Run a Step to Measure
+      return 1;
+
+    // Rendering always leaves at least a tenth of the target to simulate
+
+    const double budget = std::max(target - other, 0.1*target);
+    credit = std::min(credit + budget/cost, (double)maxsteps);
+
+    const int steps = (int)credit;
+    credit -= steps;
+    return steps;
+
+  }
+
+  // Timed Work
+
+  template<typename F>
+  double time(F&& work){
+    const clock::time_point start = clock::now();
+    work();
+    const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+    simulated += seconds;
+    return seconds;
+  }
+
+  void erode(double seconds, size_t droplets){
+    if(droplets > 0)
+      measure(droplet, seconds/droplets);
+  }
+
+  void grow(double seconds, size_t plants){
+    measure(plant, seconds/std::max(plants, (size_t)1));
+  }
+
+};
+
+#endif
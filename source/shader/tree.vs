@@ -2,7 +2,11 @@
 
 layout(location = 0) in vec4 in_Pos;
 layout(location = 1) in vec3 in_Normal;
-layout(location = 2) in mat4 in_Model;
+layout(location = 2) in vec4 in_Instance;   // Position, Birth Tick
+
+uniform float tick;
+uniform float growRate;
+uniform float maxSize;
 
 uniform mat4 proj;
 uniform mat4 view;
@@ -12,9 +16,10 @@ out vec3 ex_Normal;
 
 void main(void) {
 
-	const vec4 v_Position = view * in_Model * in_Pos;
+	const float size = maxSize*(1.0 - pow(1.0 - growRate, tick - in_Instance.w + 1.0));
+	const vec4 v_Position = view * vec4(in_Instance.xyz + size*(in_Pos.xyz + vec3(0, 1, 0)), 1.0);
 	ex_Position = v_Position;
-	ex_Normal = transpose(inverse(mat3(view * in_Model))) * normalize(in_Normal);
+	ex_Normal = transpose(inverse(mat3(view))) * normalize(in_Normal);
 	gl_Position = proj*v_Position;
 
 }
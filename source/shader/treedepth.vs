@@ -2,12 +2,17 @@
 
 layout(location = 0) in vec4 in_Pos;
 layout(location = 1) in vec3 in_Normal;
-layout(location = 2) in mat4 in_Model;
+layout(location = 2) in vec4 in_Instance;   // Position, Birth Tick
+
+uniform float tick;
+uniform float growRate;
+uniform float maxSize;
 
 uniform mat4 dvp;
 
 void main(){
 
-  gl_Position = dvp*in_Model*in_Pos;
+  const float size = maxSize*(1.0 - pow(1.0 - growRate, tick - in_Instance.w + 1.0));
+  gl_Position = dvp*vec4(in_Instance.xyz + size*(in_Pos.xyz + vec3(0, 1, 0)), 1.0);
 
 }
@@ -0,0 +1,198 @@
+#ifndef SIMPLEHYDROLOGY_SPAWN
+#define SIMPLEHYDROLOGY_SPAWN
+
+/*
+================================================================================
+                      Importance Sampled Droplet Spawning
+================================================================================
+  Droplets only descend from cells at or above the spawn height. Instead of
+  drawing uniform cells and rejecting those below it, every node keeps an
+  alias table over its valid cells, optionally weighted by a rainfall map,
+  so that every drawn cell spawns a droplet.
+
+  Draws are either independent, or follow the R2 low-discrepancy sequence
+  with a random offset per node, which covers a node evenly after far fewer
+  droplets. Under importance sampling, the R2 point selects the alias table
+  column and the coin, so both compose.
+
+  Validity changes as the terrain erodes. The number of cells whose validity
+  differs from the table is counted during the field update of every erode
+  call, and a node's table is rebuilt once that exceeds a fraction of it.
+*/
+
+// Vose Alias Table: O(n) Construction, O(1) Sampling
+
+struct Alias {
+
+  std::vector<float> prob;                // Probability of Keeping a Column
+  std::vector<uint> alias;                // Alternative of a Column
+
+  void build(const std::vector<float>& weights){
+
+    const size_t n = weights.size();
+    prob.resize(n);
+    alias.resize(n);
+
+    double sum = 0.0;
+    for(auto& w: weights)
+      sum += w;
+
+    std::vector<double> p(n);
+    std::vector<uint> small, large;
+    for(size_t i = 0; i < n; i++){
+      p[i] = weights[i]*n/sum;
+      if(p[i] < 1.0) small.push_back(i);
+      else large.push_back(i);
+    }
+
+    while(!small.empty() && !large.empty()){
+      const uint s = small.back(); small.pop_back();
+      const uint l = large.back(); large.pop_back();
+      prob[s] = p[s];
+      alias[s] = l;
+      p[l] = (p[l] + p[s]) - 1.0;
+      if(p[l] < 1.0) small.push_back(l);
+      else large.push_back(l);
+    }
+
+    // Remaining Columns are Full (up to Rounding)
+
+    for(auto& l: large) prob[l] = 1.0f;
+    for(auto& s: small) prob[s] = 1.0f;
+
+  }
+
+  // Sample with a Uniform Column and a Uniform Float in [0, 1)
+
+  inline uint sample(uint column, float u) const {
+    column %= prob.size();
+    return (u < prob[column]) ? column : alias[column];
+  }
+
+};
+
+struct Spawner {
+
+  static constexpr float minheight = 0.1f;  // Minimum Spawn Height
+  static constexpr float maxstale = 0.001f; // Stale Fraction before Rebuild
+
+  Alias table;
+  std::vector<uint> cells;                  // Slice Index of Table Columns
+  std::vector<uint8_t> valid;               // Cell Validity at Build
+  std::vector<uint8_t> changed;             // Validity differs from the Build
+  size_t stale = 0;                         // Cells whose Validity Changed
+  bool built = false;
+
+  bool seeded = false;                      // R2 Sequence State
+  double sequence[2] = {0.0, 0.0};
+
+  // Rainfall is an optional world-order weight plane (empty: uniform)
+
+  void build(quad::node& node, const std::vector<float>& rain){
+
+    const size_t n = node.s.size();
+    valid.assign(n, 0);
+    changed.assign(n, 0);
+    cells.clear();
+
+    std::vector<float> weights;
+    for(size_t i = 0; i < n; i++){
+
+      const float h = node.s.root.start[i].height;
+      if(h < minheight)
+        continue;
+
+      float w = 1.0f;
+      if(!rain.empty()){
+        const ivec2 p = node.pos + node.lod*math::unflatten(i, node.s.res);
+        w = rain[math::flatten(p, quad::res)];
+      }
+
+      valid[i] = 1;
+      if(w <= 0.0f)
+        continue;
+
+      cells.push_back(i);
+      weights.push_back(w);
+
+    }
+
+    if(!cells.empty())
+      table.build(weights);
+
+    stale = 0;
+    built = true;
+
+  }
+
+  inline bool current() const {
+    return built && stale <= maxstale*valid.size();
+  }
+
+  // Count Cells whose Validity differs from the last Build, once each
+
+  inline void check(size_t i, float height){
+    if(!built) return;
+    const uint8_t differs = valid[i] != (height >= minheight);
+    if(differs == changed[i]) return;
+    changed[i] = differs;
+    if(differs) stale++;
+    else stale--;
+  }
+
+  // Next Point of the R2 Sequence in [0, 1)^2 (Roberts, Plastic Number)
+
+  template<typename R>
+  inline vec2 next(R& rng){
+
+    static constexpr double g = 1.32471795724474602596;
+    static constexpr double alpha[2] = { 1.0/g, 1.0/(g*g) };
+
+    if(!seeded){
+      sequence[0] = (double)rng()/4294967296.0;
+      sequence[1] = (double)rng()/4294967296.0;
+      seeded = true;
+    }
+
+    for(int k = 0; k < 2; k++){
+      sequence[k] += alpha[k];
+      if(sequence[k] >= 1.0)
+        sequence[k] -= 1.0;
+    }
+
+    return vec2(sequence[0], sequence[1]);
+
+  }
+
+  // Draw a Spawn Position
+
+  template<typename R>
+  inline ivec2 sample(quad::node& node, R& rng, bool importance, bool r2){
+
+    if(!r2 && !importance)
+      return node.pos + ivec2(rng()%quad::tileres.x, rng()%quad::tileres.y);
+
+    uint column;
+    float u;
+
+    if(r2){
+      const vec2 p = next(rng);
+      if(!importance)
+        return node.pos + node.lod*glm::min(ivec2(p*vec2(node.s.res)), node.s.res - 1);
+      column = std::min((uint)(p.x*cells.size()), (uint)cells.size() - 1);
+      u = p.y;
+    }
+
+    else {
+      column = rng();
+      u = (float)(rng() >> 8)*(1.0f/16777216.0f);
+    }
+
+    const uint i = cells[table.sample(column, u)];
+    return node.pos + node.lod*math::unflatten(i, node.s.res);
+
+  }
+
+};
+
+#endif
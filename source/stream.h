@@ -0,0 +1,175 @@
+#ifndef SIMPLEHYDROLOGY_STREAM
+#define SIMPLEHYDROLOGY_STREAM
+
+/*
+SimpleHydrology - stream.h
+
+Defines a landscape evolution model for
+large scales: implicit stream power law
+incision with uplift and hillslope diffusion.
+*/
+
+class World;
+
+struct Stream {
+
+  //Parameters
+
+  struct Param {
+    int iterations = 10;                // Time Steps per Erosion Step
+    float dt = 1.0f;                    // Time Step
+    float uplift = 0.005f;              // Uplift Rate (World Units)
+    float erodibility = 0.005f;         // Stream Power Constant K
+    float m = 0.5f;                     // Drainage Area Exponent (n = 1)
+    float diffusion = 0.05f;            // Hillslope Diffusivity
+  };
+
+  // World-Sized Planes (World Order)
+
+  std::vector<float> z;                 // Terrain Height (Scaled by mapscale)
+  std::vector<float> t;                 // Diffusion Scratch
+
+  Flood fill;                           // Filled Surface for the Receivers
+  Flow flow;                            // Receivers, Stack, Drainage Area
+
+  void erode(World& world);
+
+};
+
+#endif
+
+// Implementations require a complete World (see world.h)
+
+#if defined(SIMPLEHYDROLOGY_WORLD_DEFINED) && !defined(SIMPLEHYDROLOGY_STREAM_IMPL)
+#define SIMPLEHYDROLOGY_STREAM_IMPL
+
+/*
+================================================================================
+                       Implicit Stream Power Evolution
+================================================================================
+  The terrain evolves under uplift U, fluvial incision by the stream power
+  law and linear hillslope diffusion:
+
+    dz/dt = U - K A^m |grad z| + D lap z
+
+  Every time step (Braun & Willett 2013):
+
+    receivers:  steepest descent (D8) over the priority-flooded surface, so
+                pits drain through their outlet and fill with time
+    area:       accumulated upstream, per basin of an edge outlet
+    incision:   implicit in the new height of the receiver,
+
+                  z_i = (z_i + U dt + F z_r) / (1 + F),  F = K dt A^m / dx
+
+                solved in one pass from the map edge upstream, since every
+                receiver precedes its donors. Stable for any time step.
+                Basins share no cells, so both run on parallel threads.
+    diffusion:  explicit on parallel rows, with the time step split so that
+                every substep is stable
+
+  The map edge is the fixed base level. Heights, and the drainage area as
+  discharge and momentum, are written back after the last time step.
+
+  Scope: the engine shapes the base terrain of the fixed quad::res map over
+  hundreds of steps. There a time step takes about 30 ms on one core, half
+  of it in the serial flood; at 4096^2 it takes about 2.7 s, so thousands of
+  steps on continental maps are out of reach of this solver.
+*/
+
+void Stream::erode(World& world){
+
+  const Param& param = world.stream;
+  const ivec2 res = quad::res;
+  const int area = res.x*res.y;
+
+  z.resize(area);
+  t.resize(area);
+
+  // Gather Terrain, the whole Map Evolves
+
+  for(auto& node: world.map.nodes){
+    if(!node.generated)
+      world.map.generate(node);
+    world.map.unshare(node);
+  }
+
+  for(auto& node: world.map.nodes)
+  for(auto [cell, pos]: node.s)
+    z[math::flatten(node.pos + quad::lodsize*pos, res)] = quad::mapscale*cell.height;
+
+  const float dx = quad::lodsize;
+  const float dt = param.dt;
+
+  const int substeps = std::max(1, (int)std::ceil(param.diffusion*dt/(0.2f*dx*dx)));
+  const float alpha = param.diffusion*dt/substeps/(dx*dx);
+
+  for(int it = 0; it < param.iterations; it++){
+
+    // Receivers, Stack, Drainage Area; the Edge is the Base Level
+
+    {
+    PROFILE("stream.routing");
+    fill.fill(z);
+    flow.receivers(fill.surface, false, world.threads);
+
+    for(int x = 0; x < res.x; x++){
+      flow.receiver[0][x*res.y] = -1;
+      flow.receiver[0][x*res.y + res.y - 1] = -1;
+    }
+
+    for(int y = 0; y < res.y; y++){
+      flow.receiver[0][y] = -1;
+      flow.receiver[0][(res.x - 1)*res.y + y] = -1;
+    }
+    }
+
+    // Drainage Area, then Implicit Incision Downstream First, per Basin
+
+    {
+    PROFILE("stream.incision");
+    flow.basins(world.rain, world.threads, [&](const std::vector<int>& basin){
+      for(const int i: basin){
+        const int r = flow.receiver[0][i];
+        if(r < 0) continue;
+        const float A = dx*dx*flow.a[i];
+        const float L = (std::abs(i - r) == 1 || std::abs(i - r) == res.y) ? dx : 1.41421356f*dx;
+        const float F = param.erodibility*dt*((param.m == 0.5f) ? sqrt(A) : pow(A, param.m))/L;
+        z[i] = (z[i] + param.uplift*dt + F*z[r])/(1.0f + F);
+      }
+    });
+    }
+
+    // Hillslope Diffusion
+
+    PROFILE("stream.diffusion");
+    for(int s = 0; s < substeps; s++){
+
+      quad::parallel([&](int thread, int n){
+        for(int x = thread; x < res.x; x += n)
+        for(int y = 0; y < res.y; y++){
+          const int i = x*res.y + y;
+          if(x == 0 || y == 0 || x == res.x - 1 || y == res.y - 1){
+            t[i] = z[i];
+            continue;
+          }
+          t[i] = z[i] + alpha*(z[i - res.y] + z[i + res.y] + z[i - 1] + z[i + 1] - 4.0f*z[i]);
+        }
+      }, world.threads);
+
+      std::swap(z, t);
+
+    }
+
+  }
+
+  // Scatter Terrain, Discharge
+
+  for(auto& node: world.map.nodes)
+  for(auto [cell, pos]: node.s)
+    cell.height = z[math::flatten(node.pos + quad::lodsize*pos, res)]/quad::mapscale;
+
+  flow.scatter(world);
+
+}
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef SIMPLEHYDROLOGY_THREADPOOL
+#define SIMPLEHYDROLOGY_THREADPOOL
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+/*
+================================================================================
+                        Work-Stealing Thread Pool
+================================================================================
+  Every worker owns a task deque. A worker pops its own newest task first,
+  and steals the oldest task of another worker when its own deque is empty.
+  Tasks submitted from a worker go to its own deque, tasks submitted from
+  outside the pool are distributed round-robin.
+*/
+
+class Threadpool {
+
+public:
+
+  Threadpool(int n = 0){
+
+    if(n <= 0)
+      n = std::max(1u, std::thread::hardware_concurrency());
+
+    for(int i = 0; i < n; i++)
+      queues.emplace_back(new queue());
+
+    for(int i = 0; i < n; i++)
+      workers.emplace_back(&Threadpool::work, this, i);
+
+  }
+
+  ~Threadpool(){
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stop = true;
+    }
+
+    wake.notify_all();
+    for(auto& worker: workers)
+      worker.join();
+
+  }
+
+  int size() const {
+    return workers.size();
+  }
+
+  void submit(std::function<void()> task){
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      queued++;
+      pending++;
+    }
+
+    const size_t i = (self.pool == this) ? self.index : (next++)%queues.size();
+    {
+      std::lock_guard<std::mutex> guard(queues[i]->lock);
+      queues[i]->tasks.push_back(std::move(task));
+    }
+
+    wake.notify_one();
+
+  }
+
+  // Block until all Submitted Tasks have Completed
+
+  void wait(){
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [&](){ return pending == 0; });
+  }
+
+private:
+
+  struct queue {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  struct worker {
+    Threadpool* pool = NULL;
+    size_t index = 0;
+  };
+
+  static thread_local worker self;
+
+  std::vector<std::unique_ptr<queue>> queues;
+  std::vector<std::thread> workers;
+
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+
+  size_t queued = 0;                // Tasks not yet Started
+  size_t pending = 0;               // Tasks not yet Completed
+  std::atomic<size_t> next{0};
+  bool stop = false;
+
+  bool pop(size_t i, std::function<void()>& task){
+
+    // Own Deque: Newest First
+
+    {
+      std::lock_guard<std::mutex> guard(queues[i]->lock);
+      if(!queues[i]->tasks.empty()){
+        task = std::move(queues[i]->tasks.back());
+        queues[i]->tasks.pop_back();
+        return true;
+      }
+    }
+
+    // Steal: Oldest First
+
+    for(size_t k = 1; k < queues.size(); k++){
+      queue& q = *queues[(i + k)%queues.size()];
+      std::lock_guard<std::mutex> guard(q.lock);
+      if(!q.tasks.empty()){
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        return true;
+      }
+    }
+
+    return false;
+
+  }
+
+  void work(size_t i){
+
+    self = {this, i};
+    std::function<void()> task;
+
+    while(true){
+
+      if(pop(i, task)){
+
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          queued--;
+        }
+
+        task();
+        task = nullptr;
+
+        std::lock_guard<std::mutex> guard(lock);
+        if(--pending == 0)
+          done.notify_all();
+        continue;
+
+      }
+
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [&](){ return stop || queued > 0; });
+      if(stop && queued == 0)
+        return;
+
+    }
+
+  }
+
+};
+
+thread_local Threadpool::worker Threadpool::self;
+
+#endif
@@ -9,48 +9,99 @@ particles and their static Density
 maps and update functions.
 */
 
+class World;
+
 struct Plant {
 
-  Plant(vec2 _pos){ pos = _pos; };
+  Plant(vec2 _pos, int _birth){ pos = _pos; birth = _birth; };
 
   // Properties
 
   glm::vec2 pos;
-  float size = 0.0;
+  int birth = 0;                            // Vegetation Tick of Birth
+  uint id = 0;                              // Unique Plant Identifier
+  int death = 0;                            // Tick of Next Random Death
+  int spread = 0;                           // Tick of Next Spread Attempt
+
+  float size(const World& world) const;     // Closed-Form Size from Age
 
   // Parameters
 
-  static float maxSize;
-  static float growRate;
-  static float maxSteep;
-  static float maxDischarge;
-  static float maxTreeHeight;
+  struct Param {
+    float maxSize = 1.5f;
+    float growRate = 0.05f;
+    float maxSteep = 0.8f;
+    float maxDischarge = 0.3f;
+    float maxTreeHeight = 0.8f;
+    float deathRate = 0.001f;
+    float spreadRate = 0.05f;
+  };
 
   // Update Functions
 
-  void root(float factor);
-  void grow();
-  static bool spawn(vec2 pos);
-  bool die();
+  void root(World& world, float factor);
+  static bool spawn(World& world, vec2 pos);
+  bool die(World& world);
 
 };
 
-float Plant::maxSize = 1.5f;
-float Plant::growRate = 0.05f;
-float Plant::maxSteep = 0.8f;
-float Plant::maxDischarge = 0.3f;
-float Plant::maxTreeHeight = 0.8f;
-
 // Vegetation Struct (Plant Container)
 
 struct Vegetation {
 
-  static std::vector<Plant> plants;
-  static bool grow();
+  std::vector<Plant> plants;
+  int tick = 0;                             // Number of Growth Steps
+  bool grow(World& world);
+
+  // Event Scheduling
+
+  struct Event {
+    uint index;                             // Plant Index at Scheduling
+    uint id;                                // Plant Identifier (Staleness)
+    int tick;                               // Scheduled Tick
+  };
+
+  static const int calendarsize = 1024;
+  std::vector<Event> calendar[calendarsize];
+  uint nextid = 0;
+
+  static int geometric(World& world, float p);
+  void add(World& world, vec2 pos);
+  void schedule(uint index);
+  void remove(World& world, uint index);
+
+  // Rendering Instances
+  //  One (x, height, z, birth) vec4 per plant, index-aligned with plants.
+  //  The size is derived from the birth tick in the vertex shader, so an
+  //  instance only changes on birth, death or when its height is refreshed.
+
+  std::vector<glm::vec4> instances;
+  std::vector<uint> dirty;                  // Changed Instance Indices
+  bool tracked = false;                     // Record Changes (Renderer Clears)
+  uint refreshrate = 4096;                  // Height Refreshes per Tick
+  uint refreshcursor = 0;
+
+  static glm::vec4 instance(World& world, const Plant& plant);
+  void mark(World& world, uint index);
+
+  // Continuous Density Mode
+
+  bool dense = false;                       // Use Density Field instead of Plants
+  std::vector<float> d;                     // Density Plane
+  std::vector<float> t;                     // Box-Filter Scratch Plane
+  std::vector<float> s;                     // Box-Filter Sum Plane
+
+  bool growDensity(World& world);
+  void sample(World& world, std::vector<Plant>& instances);
 
 };
 
-std::vector<Plant> Vegetation::plants;
+#endif
+
+// Implementations require a complete World (see world.h)
+
+#if defined(SIMPLEHYDROLOGY_WORLD_DEFINED) && !defined(SIMPLEHYDROLOGY_VEGETATION_IMPL)
+#define SIMPLEHYDROLOGY_VEGETATION_IMPL
 
 /*
 ================================================================================
@@ -60,131 +111,428 @@ std::vector<Plant> Vegetation::plants;
 
 // Plant Specific Methods
 
-void Plant::grow(){
-  size += growRate*(maxSize-size);
+// The growth recurrence size += growRate*(maxSize-size) is applied once
+// per tick starting with the tick of birth, which has the closed form:
+
+float Plant::size(const World& world) const {
+  const float age = (float)world.vegetation.tick - (float)birth + 1.0f;
+  return world.plant.maxSize*(1.0f - pow(1.0f - world.plant.growRate, age));
 };
 
-bool Plant::die(){
+// Deterministic Death (Random Death is Scheduled)
 
-  if( World::map.discharge(pos) >= Plant::maxDischarge ) return true;
-  if( World::map.height(pos) >= Plant::maxTreeHeight) return true;
-  if( rand()%1000 == 0 ) return true;
+bool Plant::die(World& world){
+
+  if( world.map.discharge(pos) >= world.plant.maxDischarge ) return true;
+  if( world.map.height(pos) >= world.plant.maxTreeHeight) return true;
+  if( world.lakes.lake(pos, world.map.height(pos)) ) return true;
   return false;
 
 }
 
-bool Plant::spawn( vec2 pos ){
+bool Plant::spawn( World& world, vec2 pos ){
 
-  if( World::map.discharge(pos) >= Plant::maxDischarge ) return false;
-  glm::vec3 n = World::map.normal(pos);
-  if( n.y < Plant::maxSteep ) return false;
-  if( World::map.height(pos) >= Plant::maxTreeHeight) return false;
+  if( world.map.discharge(pos) >= world.plant.maxDischarge ) return false;
+  if( world.lakes.lake(pos, world.map.height(pos)) ) return false;
+  glm::vec3 n = world.map.normal(pos);
+  if( n.y < world.plant.maxSteep ) return false;
+  if( world.map.height(pos) >= world.plant.maxTreeHeight) return false;
 
   return true;
 
 }
 
-void Plant::root(float f){
+void Plant::root(World& world, float f){
 
   quad::cell* c;
 
-  c = World::map.getCell( pos + vec2( 0, 0) );
+  c = world.map.write( pos + vec2( 0, 0) );
   if(c != NULL) c->rootdensity += f*1.0f;
 
-  c = World::map.getCell( pos + vec2( 1, 0) );
+  c = world.map.write( pos + vec2( 1, 0) );
   if(c != NULL) c->rootdensity += f*0.6f;
 
-  c = World::map.getCell( pos + vec2(-1, 0) );
+  c = world.map.write( pos + vec2(-1, 0) );
   if(c != NULL) c->rootdensity += f*0.6f;
 
-  c = World::map.getCell( pos + vec2( 0, 1) );
+  c = world.map.write( pos + vec2( 0, 1) );
   if(c != NULL) c->rootdensity += f*0.6f;
 
-  c = World::map.getCell( pos + vec2( 0,-1) );
+  c = world.map.write( pos + vec2( 0,-1) );
   if(c != NULL) c->rootdensity += f*0.6f;
 
-  c = World::map.getCell( pos + vec2(-1,-1) );
+  c = world.map.write( pos + vec2(-1,-1) );
   if(c != NULL) c->rootdensity += f*0.4f;
 
-  c = World::map.getCell( pos + vec2( 1,-1) );
+  c = world.map.write( pos + vec2( 1,-1) );
   if(c != NULL) c->rootdensity += f*0.4f;
 
-  c = World::map.getCell( pos + vec2(-1, 1) );
+  c = world.map.write( pos + vec2(-1, 1) );
   if(c != NULL) c->rootdensity += f*0.4f;
 
-  c = World::map.getCell( pos + vec2( 1, 1) );
+  c = world.map.write( pos + vec2( 1, 1) );
   if(c != NULL) c->rootdensity += f*0.4f;
 
 }
 
 // Vegetation Specific Methods
 
-bool Vegetation::grow(){
+/*
+  Random deaths and spread attempts are Bernoulli trials per tick, so the
+  number of ticks until the next success is geometrically distributed.
+  Instead of rolling the dice every tick, each plant samples the tick of
+  its next event, which is filed in a calendar queue bucketed by tick.
+  Entries whose plant has since moved or died are detected by the id.
+*/
+
+int Vegetation::geometric(World& world, float p){
+
+  if(p >= 1.0f) return 1;
+  if(p <= 0.0f) return std::numeric_limits<int>::max()/2;
+
+  const double u = ((double)world.rng() + 1.0)/((double)world.rng.max() + 1.0);
+  return 1 + (int)floor(log(u)/log(1.0 - p));
+
+}
+
+void Vegetation::add(World& world, vec2 pos){
+
+  plants.emplace_back(pos, tick);
+
+  Plant& plant = plants.back();
+  plant.id = nextid++;
+  plant.death  = tick - 1 + geometric(world, world.plant.deathRate);
+  plant.spread = tick - 1 + geometric(world, world.plant.spreadRate);
+  plant.root(world, 1.0);
+
+  schedule(plants.size() - 1);
+
+  instances.emplace_back();
+  mark(world, plants.size() - 1);
+
+}
+
+void Vegetation::schedule(uint index){
+
+  const Plant& plant = plants[index];
+  calendar[plant.death%calendarsize].push_back({index, plant.id, plant.death});
+  calendar[plant.spread%calendarsize].push_back({index, plant.id, plant.spread});
+
+}
+
+void Vegetation::remove(World& world, uint index){
+
+  plants[index].root(world, -1.0);
+
+  // Swap-Remove, Re-File the Moved Plant at its New Index
+
+  plants[index] = plants.back();
+  plants.pop_back();
+
+  instances[index] = instances.back();
+  instances.pop_back();
+
+  if(index < plants.size()){
+    schedule(index);
+    if(tracked) dirty.push_back(index);
+  }
+
+}
+
+glm::vec4 Vegetation::instance(World& world, const Plant& plant){
+  return glm::vec4(plant.pos.x, quad::mapscale*world.map.height(plant.pos), plant.pos.y, (float)plant.birth);
+}
+
+void Vegetation::mark(World& world, uint index){
+  instances[index] = instance(world, plants[index]);
+  if(tracked) dirty.push_back(index);
+}
+
+bool Vegetation::grow(World& world){
+
+  PROFILE("vegetation.grow");
+
+  tick++;
+
+  if(dense)
+    return growDensity(world);
 
   //Random Position
   {
 
-    int x = rand()%(quad::res.x);
-    int y = rand()%(quad::res.y);
+    int x = world.rng()%(quad::res.x);
+    int y = world.rng()%(quad::res.y);
 
-    if( Plant::spawn(vec2(x, y)) ){
+    if( Plant::spawn(world, vec2(x, y)) )
+      add(world, vec2(x, y));
 
-      plants.emplace_back(vec2(x, y));
-      plants.back().root(1.0);
+  }
 
-    }
+  // Deterministic Deaths
 
+  for(uint i = 0; i < plants.size();){
+    if(plants[i].die(world)) remove(world, i);
+    else i++;
   }
 
-  // Iterate over Plants
+  // Process Due Events
+  //  Plants born this tick can have events due this tick,
+  //  so the bucket is drained until no due events remain.
+  //  Deaths come first: removals re-file moved plants into
+  //  the bucket, which is drained before any plant spreads.
 
-  for(int i = 0; i < plants.size(); i++){
+  std::vector<Event>& bucket = calendar[tick%calendarsize];
+  std::vector<Event> due, later, spreads;
 
-    //Grow the Plant
-
-    plants[i].grow();
+  while(!bucket.empty()){
 
     // Check for Kill Plant
 
-    if( plants[i].die() ){
+    while(!bucket.empty()){
+
+      due.clear();
+      std::swap(due, bucket);
+
+      for(const Event& e: due){
+
+        if(e.index >= plants.size() || plants[e.index].id != e.id)
+          continue;
+
+        if(e.tick != tick){
+          later.push_back(e);
+          continue;
+        }
 
-       plants[i].root(-1.0);
-       plants.erase(plants.begin()+i);
-       i--;
-       continue;
+        if(plants[e.index].death == tick)
+          remove(world, e.index);
+        else spreads.push_back(e);
+
+      }
 
     }
 
     // Check for Growth
+    //  New plants are only appended, so indices stay valid
 
-    if(rand()%20 != 0)
-      continue;
+    for(const Event& e: spreads){
 
-    //Find New Position
-    glm::vec2 npos = plants[i].pos + glm::vec2(rand()%9-4, rand()%9-4);
+      if(e.index >= plants.size() || plants[e.index].id != e.id)
+        continue;
 
-    //Check for Out-Of-Bounds
-    if(World::map.oob(npos))
-      continue;
+      Plant& plant = plants[e.index];
 
-    if(World::map.discharge(npos) >= Plant::maxDischarge)
-      continue;
+      if(plant.spread != tick)
+        continue;
 
-    if((float)(rand()%1000)/1000.0 <= World::map.getCell(npos)->rootdensity)
-      continue;
+      plant.spread = tick + geometric(world, world.plant.spreadRate);
+      calendar[plant.spread%calendarsize].push_back({e.index, plant.id, plant.spread});
 
-    glm::vec3 n = World::map.normal(npos);
+      //Find New Position
+      glm::vec2 npos = plant.pos + glm::vec2((int)(world.rng()%9)-4, (int)(world.rng()%9)-4);
 
-    if( n.y <= Plant::maxSteep )
-      continue;
+      //Check for Out-Of-Bounds
+      if(world.map.oob(npos))
+        continue;
+
+      if(world.map.discharge(npos) >= world.plant.maxDischarge)
+        continue;
+
+      if(world.lakes.lake(npos, world.map.height(npos)))
+        continue;
+
+      if((float)(world.rng()%1000)/1000.0 <= world.map.getCell(npos)->rootdensity)
+        continue;
+
+      glm::vec3 n = world.map.normal(npos);
+
+      if( n.y <= world.plant.maxSteep )
+        continue;
+
+      // Would Die in the Same Tick
+
+      if(world.map.height(npos) >= world.plant.maxTreeHeight)
+        continue;
 
-    plants.emplace_back(npos);
-    plants.back().root(1.0);
+      add(world, npos);
 
+    }
+
+    spreads.clear();
+
+  }
+
+  std::swap(bucket, later);
+
+  // Refresh a Window of Instance Heights (Erosion)
+
+  const uint refresh = std::min((uint)plants.size(), refreshrate);
+  for(uint k = 0; k < refresh; k++){
+    refreshcursor = (refreshcursor + 1)%plants.size();
+    mark(world, refreshcursor);
   }
 
   return true;
 
 };
 
+/*
+================================================================================
+                  Continuous Vegetation Density Implementation
+================================================================================
+  Instead of tracking individual plants, every cell carries the expected
+  number of plants rooted in it. The plane is advanced with the same rules
+  as the plant particles, so that runtime scales with area and not count:
+
+    spawn:  a random suitable cell is seeded each tick
+    death:  cells above maxDischarge / maxTreeHeight are cleared,
+            otherwise density decays by deathRate
+    spread: spreadRate of the density in a 9x9 neighborhood is scattered
+            uniformly, and takes root in suitable, uncrowded cells
+
+  The root density is then the plant root kernel applied to the density.
+  All passes operate on flat world-sized planes so they vectorize.
+*/
+
+bool Vegetation::growDensity(World& world){
+
+  // Density Plane at the Cell Size of the Map
+
+  const ivec2 res = quad::res/world.map.lod;
+
+  d.resize(res.x*res.y);
+  t.resize(res.x*res.y);
+  s.resize(res.x*res.y);
+
+  // Gather the Density Plane
+
+  for(auto& node: world.map.nodes)
+  for(auto [cell, pos]: node.s)
+    d[math::flatten(node.pos/node.lod + pos, res)] = (node.generated)?cell.density:0.0f;
+
+  // Separable 9x9 Box Sum (Spread Source)
+
+  for(int x = 0; x < res.x; x++){
+    const float* in = &d[x*res.y];
+    float* out = &t[x*res.y];
+    for(int y = 0; y < res.y; y++){
+      float sum = 0.0f;
+      for(int k = std::max(0, y-4); k <= std::min(res.y-1, y+4); k++)
+        sum += in[k];
+      out[y] = sum;
+    }
+  }
+
+  for(int x = 0; x < res.x; x++){
+    float* out = &s[x*res.y];
+    for(int y = 0; y < res.y; y++)
+      out[y] = 0.0f;
+    for(int k = std::max(0, x-4); k <= std::min(res.x-1, x+4); k++){
+      const float* in = &t[k*res.y];
+      for(int y = 0; y < res.y; y++)
+        out[y] += in[y];
+    }
+  }
+
+  // Reaction Step: Death, Spread
+
+  const float spread = world.plant.spreadRate/81.0f;
+
+  for(auto& node: world.map.nodes)
+  for(auto [cell, pos]: node.s){
+
+    if(!node.generated)
+      break;
+
+    const ivec2 p = node.pos + node.lod*pos;
+    const int i = math::flatten(node.pos/node.lod + pos, res);
+
+    if(node.discharge(p) >= world.plant.maxDischarge
+    || cell.height >= world.plant.maxTreeHeight
+    || world.lakes.lake(p, cell.height)){
+      d[i] = 0.0f;
+      continue;
+    }
+
+    float n = d[i]*(1.0f - world.plant.deathRate);
+    if(node.normal(p).y > world.plant.maxSteep)
+      n += spread*s[i]*std::max(0.0f, 1.0f - cell.rootdensity);
+
+    d[i] = std::min(1.0f, n);
+
+  }
+
+  // Random Spawn
+
+  {
+
+    int x = world.rng()%(quad::res.x);
+    int y = world.rng()%(quad::res.y);
+
+    if( Plant::spawn(world, vec2(x, y)) )
+      d[math::flatten(ivec2(x, y)/world.map.lod, res)] = 1.0f;
+
+  }
+
+  // Scatter the Density and Root Kernel
+
+  for(auto& node: world.map.nodes)
+    if(node.generated)
+      world.map.unshare(node);
+
+  for(auto& node: world.map.nodes)
+  for(auto [cell, pos]: node.s){
+
+    if(!node.generated)
+      break;
+
+    const ivec2 p = node.pos/node.lod + pos;
+    cell.density = d[math::flatten(p, res)];
+
+    float r = 0.0f;
+    for(int x = -1; x <= 1; x++)
+    for(int y = -1; y <= 1; y++){
+      const ivec2 q = p + ivec2(x, y);
+      if(q.x < 0 || q.y < 0 || q.x >= res.x || q.y >= res.y)
+        continue;
+      const float w = (x == 0 && y == 0) ? 1.0f : (x == 0 || y == 0) ? 0.6f : 0.4f;
+      r += w*d[math::flatten(q, res)];
+    }
+    cell.rootdensity = r;
+
+  }
+
+  return true;
+
+}
+
+// Sample Plant Instances from the Density Field
+
+void Vegetation::sample(World& world, std::vector<Plant>& instances){
+
+  instances.clear();
+
+  for(auto& node: world.map.nodes)
+  for(auto [cell, pos]: node.s){
+
+    if(!node.generated)
+      break;
+
+    if(cell.density <= 0.0f)
+      continue;
+
+    // Stable Per-Cell Hash, so Instances don't Flicker
+
+    const ivec2 p = node.pos + node.lod*pos;
+    uint h = (uint)p.x*73856093u ^ (uint)p.y*19349663u;
+    h ^= h >> 13; h *= 0x5bd1e995u; h ^= h >> 15;
+
+    if((float)(h & 0xFFFF)/65536.0f >= cell.density)
+      continue;
+
+    instances.emplace_back(p, std::numeric_limits<int>::min());  // Fully Grown
+
+  }
+
+}
+
 #endif
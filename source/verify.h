@@ -0,0 +1,242 @@
+#ifndef SIMPLEHYDROLOGY_VERIFY
+#define SIMPLEHYDROLOGY_VERIFY
+
+#include "ensemble.h"
+
+/*
+================================================================================
+                        Golden Hash Determinism Check
+================================================================================
+  Runs a fixed set of cases headless and hashes the final height, discharge,
+  momentum and root density planes and the plant list of every case. Cases
+  are given as an ensemble member file (see ensemble.h).
+
+  In record mode, the hashes and the full field planes of every case are
+  stored in a golden directory. Otherwise every case is compared against it:
+
+    exact:      all hashes must match
+    tolerance:  the maximum absolute error of every field must be within it,
+                for kernels which may reorder floating point operations.
+                Plant placement depends on thresholds of these fields, so
+                the plant list is only reported.
+
+  Per-field error statistics are printed for every case which does not match.
+*/
+
+namespace verify {
+
+const int hashes = 5;
+const char* names[hashes] = { "height", "discharge", "momentum", "rootdensity", "plants" };
+const char* fieldnames[ensemble::fields] = { "height", "discharge", "momentumx", "momentumy", "rootdensity" };
+
+struct digest {
+  std::string hash[hashes];
+  size_t plants = 0;
+};
+
+struct error {
+  double max = 0.0;                       // Maximum Absolute Error
+  double mean = 0.0;                      // Mean Absolute Error
+  double rms = 0.0;                       // Root Mean Square Error
+  size_t count = 0;                       // Differing Cells
+};
+
+digest compute(World& world){
+
+  digest d;
+  std::vector<float> p, q;
+
+  const int planes[hashes-1][2] = { {0, 0}, {1, 1}, {2, 3}, {4, 4} };
+  for(int h = 0; h < hashes-1; h++){
+    ensemble::plane(world, planes[h][0], p);
+    if(planes[h][1] != planes[h][0]){
+      ensemble::plane(world, planes[h][1], q);
+      p.insert(p.end(), q.begin(), q.end());
+    }
+    d.hash[h] = cache::key(&p[0], p.size()*sizeof(float));
+  }
+
+  struct entry {
+    float x, y;
+    int32_t birth;
+  };
+
+  std::vector<entry> plants;
+  for(auto& plant: world.vegetation.plants)
+    plants.push_back({plant.pos.x, plant.pos.y, plant.birth});
+
+  d.hash[hashes-1] = cache::key(plants.data(), plants.size()*sizeof(entry));
+  d.plants = plants.size();
+  return d;
+
+}
+
+// Digest File: One "name hash" Line per Hash, then the Plant Count
+
+bool save(std::string path, const digest& d){
+
+  std::ofstream out(path);
+  for(int h = 0; h < hashes; h++)
+    out<<names[h]<<" "<<d.hash[h]<<std::endl;
+  out<<"count "<<d.plants<<std::endl;
+  return out.good();
+
+}
+
+bool load(std::string path, digest& d){
+
+  std::ifstream in(path);
+  std::string name, value;
+  int found = 0;
+
+  while(in >> name >> value){
+    if(name == "count") d.plants = std::stoul(value);
+    for(int h = 0; h < hashes; h++)
+      if(name == names[h]){
+        d.hash[h] = value;
+        found++;
+      }
+  }
+
+  return found == hashes;
+
+}
+
+error compare(const std::vector<float>& a, const std::vector<float>& b){
+
+  error e;
+  for(size_t i = 0; i < a.size(); i++){
+    const double diff = std::abs((double)a[i] - (double)b[i]);
+    if(diff != 0.0) e.count++;
+    e.max = std::max(e.max, diff);
+    e.mean += diff;
+    e.rms += diff*diff;
+  }
+
+  if(!a.empty()){
+    e.mean /= a.size();
+    e.rms = sqrt(e.rms/a.size());
+  }
+
+  return e;
+
+}
+
+// Record or Verify all Cases, Configured from a Base World
+
+bool run(std::string file, std::string golden, bool record, float tolerance, int threads, World& base, mappool::pool<quad::cell>& cellpool){
+
+  std::vector<ensemble::member> cases = ensemble::parse(file);
+  if(cases.empty()){
+    std::cout<<"verify: no cases in "<<file<<std::endl;
+    return false;
+  }
+
+  if(!ensemble::validate(cases, base))
+    return false;
+
+  if(record)
+    mkdir(golden.c_str(), 0755);
+
+  Threadpool pool(threads);
+  ensemble::parents ps = ensemble::collect(cases);
+  cellpool.reserve((ps.size() + std::min(cases.size(), (size_t)pool.size()))*quad::area);
+  ensemble::prepare(ps, base, pool, cellpool);
+
+  std::vector<std::string> reports(cases.size());
+  std::vector<char> passed(cases.size(), 0);
+
+  std::cout<<(record?"Recording ":"Verifying ")<<cases.size()<<" Cases on "<<pool.size()<<" Threads"<<std::endl;
+
+  for(size_t i = 0; i < cases.size(); i++)
+  pool.submit([&, i](){
+
+    const ensemble::member& m = cases[i];
+    const std::string path = golden + "/case" + std::to_string(i);
+
+    std::unique_ptr<World> world = ensemble::configure(m, base);
+    ensemble::simulate(*world, m, cellpool, ensemble::find(ps, m));
+
+    const digest d = compute(*world);
+    std::ostringstream report;
+    report<<"Case "<<i<<" (Seed "<<m.seed<<", "<<m.steps<<" Steps): ";
+
+    if(record){
+
+      passed[i] = save(path + ".hash", d) && ensemble::write(path + ".fields", *world);
+      report<<(passed[i]?"Recorded":"Failed to Write")<<std::endl;
+
+    }
+
+    else {
+
+      digest g;
+      if(!load(path + ".hash", g)){
+        report<<"No Golden at "<<path<<".hash"<<std::endl;
+        world->map.release();
+        reports[i] = report.str();
+        return;
+      }
+
+      bool exact = true;
+      for(int h = 0; h < hashes; h++)
+        exact = exact && (d.hash[h] == g.hash[h]);
+
+      if(exact){
+        passed[i] = true;
+        report<<"Exact Match"<<std::endl;
+      }
+
+      else {
+
+        // Per-Field Error Statistics against the Golden Planes
+
+        std::vector<float> planes[ensemble::fields];
+        bool ok = ensemble::read(path + ".fields", planes);
+        bool within = ok && (tolerance > 0.0f);
+
+        std::ostringstream fields;
+        std::vector<float> p;
+        for(int f = 0; f < ensemble::fields && ok; f++){
+          ensemble::plane(*world, f, p);
+          const error e = compare(p, planes[f]);
+          within = within && (e.max <= tolerance);
+          fields<<"  "<<fieldnames[f]<<": max "<<e.max<<" mean "<<e.mean<<" rms "<<e.rms<<" differing "<<e.count<<std::endl;
+        }
+
+        passed[i] = within;
+        report<<(within?"Within Tolerance":"Mismatch")<<std::endl;
+        for(int h = 0; h < hashes; h++)
+          if(d.hash[h] != g.hash[h])
+            report<<"  "<<names[h]<<" hash "<<d.hash[h]<<" (golden "<<g.hash[h]<<")"<<std::endl;
+        report<<"  plant count "<<d.plants<<" (golden "<<g.plants<<")"<<std::endl;
+        if(!ok) report<<"  no readable golden fields at "<<path<<".fields"<<std::endl;
+        report<<fields.str();
+
+      }
+
+    }
+
+    world->map.release();
+    reports[i] = report.str();
+
+  });
+
+  pool.wait();
+
+  const bool unchanged = ensemble::unchanged(ps);
+
+  size_t count = 0;
+  for(size_t i = 0; i < cases.size(); i++){
+    std::cout<<reports[i];
+    count += passed[i];
+  }
+
+  std::cout<<count<<" / "<<cases.size()<<" Cases "<<(record?"Recorded":"Passed")<<std::endl;
+  return unchanged && count == cases.size();
+
+}
+
+}; // namespace verify
+
+#endif
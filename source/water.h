@@ -1,6 +1,8 @@
 #ifndef SIMPLEHYDROLOGY_WATER
 #define SIMPLEHYDROLOGY_WATER
 
+#include <bit>
+
 /*
 SimpleHydrology - water.h
 
@@ -9,6 +11,8 @@ the method for descending / eroding
 the landscape.
 */
 
+class World;
+
 struct Drop {
 
   Drop(glm::vec2 _pos){ pos = _pos; }   // Construct at Position
@@ -21,33 +25,82 @@ struct Drop {
 
   float volume = 1.0;                   // Droplet Water Volume
   float sediment = 0.0;                 // Droplet Sediment Concentration
+  int lake = -1;                        // Lake last Spilled from
 
   //Parameters
 
-  static float maxAge;                  // Maximum Droplet Age
-  static float minVol;                  // Minimum Droplet Volume
-  static float evapRate;                // Droplet Evaporation Rate
-  static float depositionRate;          // Droplet Deposition Rate
-  static float entrainment;             // Additional Sediment per Discharge
-  static float gravity;                 // Gravity Force Scale
-  static float momentumTransfer;        // Rate of Momentum Transfer
+  struct Param {
+    float maxAge = 500;                 // Maximum Droplet Age
+    float minVol = 0.01;                // Minimum Droplet Volume
+    float evapRate = 0.001;             // Droplet Evaporation Rate
+    float depositionRate = 0.1;         // Droplet Deposition Rate
+    float entrainment = 10.0f;          // Additional Sediment per Discharge
+    float gravity = 1.0f;               // Gravity Force Scale
+    float momentumTransfer = 1.0f;      // Rate of Momentum Transfer
+  };
+
+  // Lifecycle Statistics
+  //  Counted by every thread into its own instance, summed per erode call.
+
+  struct Stats {
+
+    enum Reason { MaxAge, MinVol, OutOfBounds, Lake, Reasons };
+    static const int bins = 12;         // Step Histogram, Power-of-Two Bins
+
+    size_t spawned = 0;                 // Droplets Spawned
+    size_t rejected = 0;                // Spawns Rejected (Below Water Level)
+    size_t steps = 0;                   // Total Steps Taken
+    size_t cascades = 0;                // Cascade Transfers Performed
+    size_t retries = 0;                 // Parallel Steps Retried on Conflict
+    size_t spilled = 0;                 // Droplets Moved to a Lake Outlet
+    size_t terminated[Reasons] = {0};   // Terminations by Reason
+    size_t histogram[bins] = {0};       // Steps per Droplet, Bin floor(log2)+1
+    double sediment = 0.0;              // Sediment Carried, Summed per Step
+
+    void end(Reason reason, int steps){
+      terminated[reason]++;
+      histogram[std::min((int)std::bit_width((unsigned int)steps), bins-1)]++;
+    }
+
+    Stats& operator+=(const Stats& o){
+      spawned += o.spawned;
+      rejected += o.rejected;
+      steps += o.steps;
+      cascades += o.cascades;
+      retries += o.retries;
+      spilled += o.spilled;
+      for(int i = 0; i < Reasons; i++) terminated[i] += o.terminated[i];
+      for(int i = 0; i < bins; i++) histogram[i] += o.histogram[i];
+      sediment += o.sediment;
+      return *this;
+    }
+
+    void print(std::ostream& out) const {
+      out<<"spawned "<<spawned<<" rejected "<<rejected<<" steps "<<steps;
+      out<<" maxAge "<<terminated[MaxAge]<<" minVol "<<terminated[MinVol]<<" oob "<<terminated[OutOfBounds]<<" lake "<<terminated[Lake]<<" spilled "<<spilled;
+      out<<" cascades "<<cascades<<" retries "<<retries<<" sediment "<<((steps > 0)?sediment/steps:0.0)<<" histogram";
+      for(int i = 0; i < bins; i++)
+        out<<" "<<histogram[i];
+      out<<std::endl;
+    }
+
+  };
 
   // Main Methods
 
-  bool descend();
+  bool descend(World& world, Stats& stats);
+  template<typename B>                  // Step under a Boundary Policy
+  bool step(World& world, Stats& stats, quad::cell* cell, B& boundary);
+  void prefetch(World& world) const;
 
 };
 
-// Parameter Definitions
+#endif
 
-float Drop::evapRate = 0.001;
-float Drop::depositionRate = 0.1;
-float Drop::minVol = 0.01;
-float Drop::maxAge = 500;
+// Implementations require a complete World (see world.h)
 
-float Drop::entrainment = 10.0f;
-float Drop::gravity = 1.0f;
-float Drop::momentumTransfer = 1.0f;
+#if defined(SIMPLEHYDROLOGY_WORLD_DEFINED) && !defined(SIMPLEHYDROLOGY_WATER_IMPL)
+#define SIMPLEHYDROLOGY_WATER_IMPL
 
 /*
 ================================================================================
@@ -55,35 +108,130 @@ float Drop::momentumTransfer = 1.0f;
 ================================================================================
 */
 
-bool Drop::descend(){
+// Boundary Policies of a Descent Step
+//  Checked accesses the map with bounds checks and node lookups. Interior
+//  is only used more than margin cells from every node edge, where the step,
+//  the normal and the new position all stay within the node's slice, and
+//  reads neighbours by pointer arithmetic from the droplet's cell.
+
+struct Checked {
+
+  static constexpr bool interior = false;
+  quad::map& map;
+  const int lod;                          // Cell Size of the Map
+
+  inline bool oob(const glm::ivec2 p){ return map.oob(p); }
+  inline float height(const glm::ivec2 p){ return map.height(p); }
+
+};
+
+struct Interior {
+
+  static constexpr bool interior = true;
+  static constexpr int margin = 3;
+
+  const quad::cell* cell;                 // Cell at the Droplet Position
+  const glm::ivec2 origin;                // Node Position
+  const glm::ivec2 local;                 // Slice Index of the Cell
+  const int stride;                       // Slice Row Length
+  const int lod;
+
+  // Offsets in Node Cells: positions in the node are non-negative, so the
+  // division floors to the cell also at coarse cell sizes
+
+  inline bool oob(const glm::ivec2){ return false; }
+  inline float height(const glm::ivec2 p){
+    const glm::ivec2 d = (p - origin)/lod - local;
+    return cell[d.x*stride + d.y].height;
+  }
+
+};
+
+bool Drop::descend(World& world, Stats& stats){
 
   const glm::ivec2 ipos = pos;
 
-  quad::node* node = World::map.get(ipos);
-  if(node == NULL)
+  quad::node* node = world.map.get(ipos);
+  if(node == NULL){
+    stats.end(Stats::OutOfBounds, age);
     return false;
+  }
+
+  world.map.unshare(*node);
 
   quad::cell* cell = node->get(ipos);
-  if(cell == NULL)
+  if(cell == NULL){
+    stats.end(Stats::OutOfBounds, age);
     return false;
+  }
+
+  const glm::ivec2 local = (ipos - node->pos)/node->lod;
+  if(local.x >= Interior::margin && local.x < node->s.res.x - Interior::margin
+  && local.y >= Interior::margin && local.y < node->s.res.y - Interior::margin){
+    Interior boundary = { cell, node->pos, local, node->s.res.y, node->lod };
+    return step(world, stats, cell, boundary);
+  }
+
+  Checked boundary = { world.map, world.map.lod };
+  return step(world, stats, cell, boundary);
 
-  const glm::vec3 n = World::map.normal(ipos);
+}
+
+template<typename B>
+bool Drop::step(World& world, Stats& stats, quad::cell* cell, B& boundary){
+
+  const Drop::Param& param = world.drop;
+  const int lod = world.map.lod;
+
+  const glm::ivec2 ipos = pos;
 
   // Termination Checks
 
-  if(age > maxAge){
+  if(age > param.maxAge){
     cell->height += sediment;
+    stats.end(Stats::MaxAge, age);
     return false;
   }
 
-  if(volume < minVol){
+  if(volume < param.minVol){
     cell->height += sediment;
+    stats.end(Stats::MinVol, age);
     return false;
   }
 
+  // Droplets entering a Lake deposit their Sediment on its Shore, and
+  //  continue with their Volume from its Outlet. Lakes without an Outlet,
+  //  or which the droplet rolled back into from it, end the droplet.
+
+  if(world.flood.enabled && world.lakes.lake(ipos, cell->height)){
+
+    cell->height += sediment;
+    sediment = 0.0f;
+
+    const int l = world.lakes.id[math::flatten(ipos, quad::res)];
+    const int outlet = world.lakes.lakes[l].outlet;
+    if(outlet < 0 || l == lake){
+      stats.end(Stats::Lake, age);
+      return false;
+    }
+
+    const glm::vec2 spill = glm::vec2(math::unflatten(outlet, quad::res));
+    if(glm::length(spill - pos) > 0.0f)
+      speed = glm::length(speed)*glm::normalize(spill - pos);
+    pos = spill;
+    lake = l;
+
+    stats.spilled++;
+    age++;
+    return true;
+
+  }
+
+  const glm::vec3 n = quad::_normal(boundary, ipos);
+
   // Effective Parameter Set
 
-  float effD = depositionRate*(1.0f - cell->rootdensity);
+  float effD = param.depositionRate*(1.0f - cell->rootdensity);
   if(effD < 0) effD = 0;
 
   // Apply Forces to Particle
@@ -92,11 +240,11 @@ bool Drop::descend(){
 
   //if(cell->height > 0.0){
 
-    speed += quad::lodsize*gravity*vec2(n.x, n.z)/volume;
+    speed += lod*param.gravity*vec2(n.x, n.z)/volume;
 
     vec2 fspeed = vec2(cell->momentumx, cell->momentumy);
     if(length(fspeed) > 0 && length(speed) > 0)
-      speed += quad::lodsize*momentumTransfer*dot(normalize(fspeed), normalize(speed))/(volume + cell->discharge)*fspeed;
+      speed += lod*param.momentumTransfer*dot(normalize(fspeed), normalize(speed))/(volume + cell->discharge)*fspeed;
 
   //}
 
@@ -106,7 +254,7 @@ bool Drop::descend(){
   // Dynamic Time-Step, Update
 
   if(length(speed) > 0)
-    speed = (quad::lodsize*sqrt(2.0f))*normalize(speed);
+    speed = (lod*sqrt(2.0f))*normalize(speed);
 
   pos   += speed;
 
@@ -118,13 +266,13 @@ bool Drop::descend(){
 
   //Out-Of-Bounds
   float h2;
-  if(World::map.oob(pos))
+  if(!B::interior && boundary.oob(pos))
     h2 = cell->height-0.002;
   else
-    h2 = World::map.height(pos);
+    h2 = boundary.height(pos);
 
   //Mass-Transfer (in MASS)
-  float c_eq = (1.0f+entrainment*node->discharge(ipos))*(cell->height-h2);
+  float c_eq = (1.0f+param.entrainment*erf(0.4f*cell->discharge))*(cell->height-h2);
   if(c_eq < 0) c_eq = 0;
   float cdiff = (c_eq - sediment);
 
@@ -132,27 +280,52 @@ bool Drop::descend(){
   cell->height -= effD*cdiff;
 
   //Evaporate (Mass Conservative)
-  sediment /= (1.0-evapRate);
-  volume *= (1.0-evapRate);
+  sediment /= (1.0-param.evapRate);
+  volume *= (1.0-param.evapRate);
+
+  stats.steps++;
+  stats.sediment += sediment;
 
   //Out-Of-Bounds
-  if(World::map.oob(pos)){
+  if(!B::interior && boundary.oob(pos)){
     volume = 0.0;
+    stats.end(Stats::OutOfBounds, age + 1);
     return false;
   }
 
 /*
-  if(World::map.height(pos) < 0.3){
+  if(world.map.height(pos) < 0.3){
     volume = 0.0;
     return false;
   }
   */
 
-  World::cascade(pos);
+  stats.cascades += world.cascade(pos);
 
   age++;
   return true;
 
 }
 
+// Prefetch the Cells the next Step reads: its Cell and the Neighbourhood
+//  of the Normal and the Cascade, which spans three rows of the slice.
+
+void Drop::prefetch(World& world) const {
+
+  const glm::ivec2 ipos = pos;
+
+  for(int dx = -1; dx <= 1; dx++){
+    const glm::ivec2 p = ipos + world.map.lod*glm::ivec2(dx, 0);
+    quad::node* node = world.map.get(p);
+    if(node == NULL)
+      continue;
+    const quad::cell* cell = node->get(p);
+    if(cell == NULL)
+      continue;
+    __builtin_prefetch(cell - 1);
+    __builtin_prefetch(cell + 1);
+  }
+
+}
+
 #endif
@@ -4,7 +4,20 @@
 #include "include/FastNoiseLite.h"
 #include "include/math.h"
 
+#include "cache.h"
 #include "cellpool.h"
+#include "profiler.h"
+#include "spawn.h"
+
+#include <random>
+#include <atomic>
+
+#include "water.h"
+#include "pipe.h"
+#include "flow.h"
+#include "flood.h"
+#include "stream.h"
+#include "vegetation.h"
 
 /*
 SimpleHydrology - world.h
@@ -12,82 +25,629 @@ SimpleHydrology - world.h
 Defines our main storage buffers,
 world updating functions for erosion
 and vegetation.
+
+A World owns its map, parameters, random
+number generator and vegetation, so that
+independent worlds can share a process.
 */
 
 class World {
 
 public:
 
-  static unsigned int SEED;
-  static quad::map map;
+  unsigned int SEED = 1;
+  quad::map map;
+  std::mt19937 rng;
 
   // Parameters
 
-  static float lrate;
-  static float dischargeThresh;
-  static float maxdiff;
-  static float settling;
+  float lrate = 0.1f;
+  float maxdiff = 0.01f;
+  float settling = 0.8f;
+
+  Drop::Param drop;
+  Plant::Param plant;
+  Pipe::Param pipe;
+  Flow::Param flow;
+  Flood::Param flood;
+  Stream::Param stream;
+
+  // Erosion Engine
+
+  enum Engine {
+    Droplets,                                 // Particle Descent (water.h)
+    Pipes,                                    // Shallow Water Grid (pipe.h)
+    Routing,                                  // Flow Accumulation (flow.h)
+    StreamPower                               // Landscape Evolution (stream.h)
+  } engine = Droplets;
+
+  Pipe grid;                                  // Pipe Model State
+  Flow routing;                               // Flow Routing Scratch
+  Flood lakes;                                // Lake Surface and Labels
+  Stream landscape;                           // Stream Power Scratch
+
+  Drop::Stats stats;                          // Droplets of the last erode
+  float residual = 0.0f;                      // Relative Discharge Change
+
+  // Droplet Spawning
+
+  bool importance = true;                     // Sample from Valid Cells Only
+  bool r2 = false;                            // Low-Discrepancy Spawn Sequence
+  std::vector<float> rain;                    // Rainfall Weights (World Order)
+  std::vector<Spawner> spawners;              // Alias Table per Node
+
+  void rainfall(std::vector<float> weights);  // Set Rainfall, Rebuild Tables
+
+  int interleave = 1;                         // Droplets in Flight per Node
+  std::vector<Drop> inflight;
+
+  // Optimistic Parallel Droplets
+  //  Every blocksize^2 block of cells has a lock word, odd while a droplet
+  //  step holds it and incremented again on commit, so it counts commits.
+  //  A step try-locks the (at most 2x2) blocks within reach and otherwise
+  //  leaves the droplet for later, so that steps never overlap.
+
+  static const int blocksize = 16;
+  static const ivec2 blockres;
+
+  int threads = 1;                            // Solver Threads (0: Hardware)
+  std::unique_ptr<std::atomic<uint32_t>[]> blocks;
+
+  int step(Drop& drop, Drop::Stats& stats);   // 1: Alive, 0: Done, -1: Conflict
+  void descend(std::vector<glm::vec2>& spawns);
+
+  // Adaptive Erosion Budget
+  //  Per-node activity is the mean absolute height change per droplet and
+  //  the relative change of the discharge average, both measured against the
+  //  previous simulated call and smoothed. A node is converged once both are
+  //  below their thresholds.
+
+  struct Activity {
+    float height = -1.0f;                     // Mean |dh| per Droplet (-1: None)
+    float drift = -1.0f;                      // Relative Discharge Change
+    int budget = 0;                           // Droplets of the current erode
+    int idle = 0;                             // Calls since Convergence
+    bool converged = false;
+    std::vector<float> previous;              // Heights at the last Measurement
+
+    void measure(float& metric, float value){
+      metric = (metric < 0.0f) ? value : 0.5f*metric + 0.5f*value;
+    }
+  };
+
+  bool adaptive = false;                      // Shift Budget to Active Nodes
+  float steady = 0.05f;                       // Converged Mean |dh| per Droplet
+  float steadydrift = 0.1f;                   // Converged Discharge Change
+  int probe = 16;                             // Calls between Converged Probes
+  std::vector<Activity> activity;             // Activity per Node
+
+  void schedule(int cycles);                  // Distribute the Droplet Budget
+  bool converged();                           // All Nodes Converged
+
+  // Multiresolution Erosion (multires.h)
+
+  int levels = 1;                             // Pyramid Levels (1: Off)
+  int coarsesteps = 32;                       // Erode Calls per Coarse Level
+
+  float* param(std::string name);             // Parameter by Name
+
+  // Vegetation
+
+  Vegetation vegetation;
 
   // Main Update Methods
 
-  static void erode(int cycles);              // Erosion Update Step
-  static void cascade(vec2 pos);              // Perform Sediment Cascade
+  void init(mappool::pool<quad::cell>& cellpool); // Seed and Generate
+  void erode(int cycles);                     // Erosion Update Step
+  int cascade(vec2 pos);                      // Sediment Cascade, Transfers
 
-};
+  void configure(const World& base);          // Copy all Parameters
+  void fork(World& branch);                   // Copy-on-Write Branch
 
-unsigned int World::SEED = 1;
+};
 
-quad::map World::map;
+// Subsystem Implementations (require a complete World)
 
-float World::lrate = 0.1f;
-float World::maxdiff = 0.01f;
-float World::settling = 0.8f;
+#define SIMPLEHYDROLOGY_WORLD_DEFINED
 
 #include "vegetation.h"
 #include "water.h"
+#include "pipe.h"
+#include "flow.h"
+#include "flood.h"
+#include "stream.h"
+
+void World::init(mappool::pool<quad::cell>& cellpool){
+
+  rng.seed(SEED);
+  map.init(cellpool, SEED);
+
+  if(flow.seed)
+    routing.route(*this);
+
+}
+
+// Copy the Parameters of another World
+//  Only the tunables are copied, no terrain or simulation state, so that
+//  forks, ensemble members and coarse levels start from the same settings.
+
+void World::configure(const World& base){
+
+  lrate = base.lrate;
+  maxdiff = base.maxdiff;
+  settling = base.settling;
+  drop = base.drop;
+  plant = base.plant;
+
+  engine = base.engine;
+  pipe = base.pipe;
+  flow = base.flow;
+  flood = base.flood;
+  stream = base.stream;
+
+  importance = base.importance;
+  r2 = base.r2;
+  rain = base.rain;
+  interleave = base.interleave;
+  threads = base.threads;
+
+  adaptive = base.adaptive;
+  steady = base.steady;
+  steadydrift = base.steadydrift;
+  probe = base.probe;
+  levels = base.levels;
+  coarsesteps = base.coarsesteps;
+
+  vegetation.dense = base.vegetation.dense;
+  map.lazy = base.map.lazy;
+  map.threads = base.map.threads;
+  map.cachedir = base.map.cachedir;
+
+}
+
+// Branch this World: All Node Slices are shared until first written
+//  The spawn tables, the activity measurements and the lakes are copied as
+//  well, so that a branch continues exactly as its parent would. Only a
+//  branch running pipes keeps the water of the grid.
+
+void World::fork(World& branch){
+
+  branch.SEED = SEED;
+  branch.rng = rng;
+  branch.configure(*this);
+
+  branch.spawners = spawners;
+  branch.activity = activity;
+  branch.residual = residual;
+
+  if(flood.enabled)
+    branch.lakes = lakes;
+
+  if(engine == Pipes)
+    branch.grid = grid;
+
+  branch.vegetation = vegetation;
+  map.fork(branch.map);
+
+}
+
+float* World::param(std::string name){
+
+  if(name == "lrate")             return &lrate;
+  if(name == "maxdiff")           return &maxdiff;
+  if(name == "settling")          return &settling;
+  if(name == "steady")            return &steady;
+  if(name == "steadyDrift")       return &steadydrift;
+
+  if(name == "maxAge")            return &drop.maxAge;
+  if(name == "minVol")            return &drop.minVol;
+  if(name == "evapRate")          return &drop.evapRate;
+  if(name == "depositionRate")    return &drop.depositionRate;
+  if(name == "entrainment")       return &drop.entrainment;
+  if(name == "gravity")           return &drop.gravity;
+  if(name == "momentumTransfer")  return &drop.momentumTransfer;
+
+  if(name == "pipeDt")            return &pipe.dt;
+  if(name == "pipeRain")          return &pipe.rain;
+  if(name == "pipeCapacity")      return &pipe.capacity;
+  if(name == "pipeErosion")       return &pipe.erosion;
+  if(name == "pipeDeposition")    return &pipe.deposition;
+  if(name == "pipeEvaporation")   return &pipe.evaporation;
+  if(name == "flowVolume")        return &flow.volume;
+  if(name == "lakeDepth")         return &flood.minDepth;
+  if(name == "streamDt")          return &stream.dt;
+  if(name == "uplift")            return &stream.uplift;
+  if(name == "erodibility")       return &stream.erodibility;
+  if(name == "diffusion")         return &stream.diffusion;
+
+  if(name == "maxSize")           return &plant.maxSize;
+  if(name == "growRate")          return &plant.growRate;
+  if(name == "maxSteep")          return &plant.maxSteep;
+  if(name == "maxDischarge")      return &plant.maxDischarge;
+  if(name == "maxTreeHeight")     return &plant.maxTreeHeight;
+  if(name == "deathRate")         return &plant.deathRate;
+  if(name == "spreadRate")        return &plant.spreadRate;
+
+  return NULL;
+
+}
+
+void World::rainfall(std::vector<float> weights){
+
+  rain = weights;
+  for(auto& spawner: spawners)
+    spawner.built = false;
+
+}
 
 /*
 ===================================================
           HYDRAULIC EROSION FUNCTIONS
 ===================================================
 */
+
+const ivec2 World::blockres = (quad::res + World::blocksize - 1)/World::blocksize;
+
+// One Droplet Step under the Locks of all Blocks it may touch:
+//  The step moves at most two cells, and the cascade reaches one further.
+//  At coarse cell sizes the reach spans more blocks, so the held locks are
+//  kept in a per-thread list instead of a fixed array.
+
+int World::step(Drop& drop, Drop::Stats& stats){
+
+  const ivec2 ipos = drop.pos;
+  const ivec2 reach = ivec2(3*map.lod);
+  const ivec2 lo = glm::clamp(ipos - reach, ivec2(0), quad::res - 1)/blocksize;
+  const ivec2 hi = glm::clamp(ipos + reach, ivec2(0), quad::res - 1)/blocksize;
+
+  thread_local std::vector<std::atomic<uint32_t>*> held;
+  held.clear();
+
+  for(int x = lo.x; x <= hi.x; x++)
+  for(int y = lo.y; y <= hi.y; y++){
+
+    std::atomic<uint32_t>& word = blocks[math::flatten(ivec2(x, y), blockres)];
+    uint32_t version = word.load(std::memory_order_relaxed);
+
+    if((version & 1) || !word.compare_exchange_strong(version, version + 1, std::memory_order_acquire)){
+      for(auto w = held.rbegin(); w != held.rend(); w++)
+        (*w)->fetch_sub(1, std::memory_order_relaxed);
+      stats.retries++;
+      return -1;
+    }
+
+    held.push_back(&word);
+
+  }
+
+  // Spawns are drawn before any droplet of the batch descends, so the
+  // spawn test is repeated on the first step against the current heights.
+
+  if(drop.age == 0){
+    const float height = map.height(ipos);
+    if(height < Spawner::minheight || (flood.enabled && lakes.lake(ipos, height))){
+      for(auto w = held.rbegin(); w != held.rend(); w++)
+        (*w)->fetch_add(1, std::memory_order_release);
+      stats.spawned--;
+      stats.rejected++;
+      return 0;
+    }
+  }
+
+  const bool alive = drop.descend(*this, stats);
+
+  for(auto w = held.rbegin(); w != held.rend(); w++)
+    (*w)->fetch_add(1, std::memory_order_release);
+
+  return alive ? 1 : 0;
+
+}
+
+// Descend all Spawned Droplets on Parallel Threads
+
+void World::descend(std::vector<glm::vec2>& spawns){
+
+  if(!blocks){
+    blocks.reset(new std::atomic<uint32_t>[blockres.x*blockres.y]);
+    for(int i = 0; i < blockres.x*blockres.y; i++)
+      blocks[i].store(0);
+  }
+
+  const int nthreads = (threads <= 0) ? std::max(1u, std::thread::hardware_concurrency()) : threads;
+  std::vector<Drop::Stats> local(nthreads);
+  std::atomic<size_t> next{0};
+
+  quad::parallel([&](int t, int){
+
+    Drop::Stats& stats = local[t];
+    std::vector<Drop> drops;
+
+    while(true){
+
+      while((int)drops.size() < std::max(interleave, 4)){
+        const size_t i = next.fetch_add(1, std::memory_order_relaxed);
+        if(i >= spawns.size()) break;
+        drops.emplace_back(spawns[i]);
+        drops.back().prefetch(*this);
+      }
+
+      if(drops.empty())
+        break;
+
+      bool progress = false;
+      for(size_t d = 0; d < drops.size();){
+        const int result = step(drops[d], stats);
+        progress = progress || (result >= 0);
+        if(result != 0){
+          if(result > 0) drops[d].prefetch(*this);
+          d++;
+        }
+        else {
+          drops[d] = drops.back();
+          drops.pop_back();
+        }
+      }
+
+      if(!progress)
+        std::this_thread::yield();
+
+    }
+
+  }, nthreads);
+
+  for(auto& s: local)
+    stats += s;
+
+}
+// Distribute the Droplet Budget over the Nodes
+//  Active nodes share the budget of all active nodes: a quarter share each,
+//  the rest in proportion to their erosion per droplet. Converged nodes are
+//  skipped, except for a quarter share every probe calls to re-measure them.
+
+void World::schedule(int cycles){
+
+  activity.resize(quad::maparea);
+
+  int active = 0;
+  double sum = 0.0;
+
+  for(int n = 0; n < quad::maparea; n++){
+    Activity& a = activity[n];
+    a.budget = 0;
+    if(!map.nodes[n].generated)
+      continue;
+    if(!adaptive || engine != Droplets){
+      a.budget = cycles;
+      continue;
+    }
+    if(a.converged){
+      if(a.idle++ % probe == 0)
+        a.budget = cycles/4;
+      continue;
+    }
+    active++;
+    sum += std::max(a.height, 0.0f);
+  }
+
+  if(!adaptive || engine != Droplets)
+    return;
+
+  for(int n = 0; n < quad::maparea; n++){
+    Activity& a = activity[n];
+    if(!map.nodes[n].generated || a.converged)
+      continue;
+    a.budget = cycles/4;
+    if(sum > 0.0) a.budget += (int)(0.75*cycles*active*std::max(a.height, 0.0f)/sum);
+    else a.budget += cycles - cycles/4;
+  }
+
+}
+
+bool World::converged(){
+
+  if(activity.empty())
+    return false;
+
+  for(int n = 0; n < quad::maparea; n++)
+    if(map.nodes[n].generated && !activity[n].converged)
+      return false;
+
+  return true;
+
+}
+
 void World::erode(int cycles){
 
-  for(auto& node: map.nodes)
-  for(auto [cell, pos]: node.s){
-    cell.discharge_track = 0;
-    cell.momentumx_track = 0;
-    cell.momentumy_track = 0;
+  PROFILE("erode");
+
+  stats = Drop::Stats();
+  schedule(cycles);
+  spawners.resize(quad::maparea);
+
+  // Nodes which were never accessed are not simulated (Lazy Generation),
+  // nodes without budget are left untouched, so forks keep sharing them.
+
+  {
+  PROFILE("erode.clear");
+  for(int n = 0; n < quad::maparea; n++){
+    quad::node& node = map.nodes[n];
+    if(activity[n].budget == 0) continue;
+    map.unshare(node);
+    for(auto [cell, pos]: node.s){
+      cell.discharge_track = 0;
+      cell.momentumx_track = 0;
+      cell.momentumy_track = 0;
+    }
+  }
+  }
+
+  // Lakes are re-flooded before the droplets, which end in them
+
+  if(flood.enabled){
+    PROFILE("erode.lakes");
+    lakes.update(*this);
+  }
+
+  if(engine == Pipes){
+    PROFILE("erode.pipes");
+    grid.erode(*this);
+  }
+
+  // Flow routing leaves the terrain and sets the averages converged
+
+  else if(engine == Routing){
+    PROFILE("erode.routing");
+    routing.route(*this);
+  }
+
+  else if(engine == StreamPower){
+    PROFILE("erode.stream");
+    landscape.erode(*this);
   }
 
   //Do a series of iterations!
-  for(auto& node: map.nodes)
-  for(int i = 0; i < cycles; i++){
+  else {
+  PROFILE("erode.droplets");
 
-    //Spawn New Particle
+  // Draw a Spawn Position on Node n: 1 valid, 0 rejected, -1 no valid cells
 
-    glm::vec2 newpos = node.pos + ivec2(rand()%quad::tileres.x, rand()%quad::tileres.y);
+  auto spawn = [&](int n, glm::vec2& pos){
 
-    if(node.height(newpos) < 0.1)
-      continue;
+    PROFILE_FINE("spawn");
+
+    quad::node& node = map.nodes[n];
+    Spawner& spawner = spawners[n];
+
+    if(importance && !spawner.current())
+      spawner.build(node, rain);
+
+    if(importance && spawner.cells.empty())
+      return -1;
+
+    pos = spawner.sample(node, rng, importance, r2);
+    const float height = node.height(pos);
+    if(height < Spawner::minheight || (flood.enabled && lakes.lake(pos, height))){
+      stats.rejected++;
+      return 0;
+    }
+
+    stats.spawned++;
+    return 1;
+
+  };
+
+  if(threads == 1)
+  for(int n = 0; n < quad::maparea; n++){
+
+    // Up to interleave droplets are in flight and advance one step each
+    // in turn, so that the prefetch of one droplet's next cells overlaps
+    // the steps of the others. A single droplet reproduces serial descent.
+
+    std::vector<Drop>& drops = inflight;
+    drops.clear();
+
+    int i = 0;
+    while(i < activity[n].budget || !drops.empty()){
+
+      while((int)drops.size() < std::max(interleave, 1) && i < activity[n].budget){
+
+        glm::vec2 newpos;
+        const int valid = spawn(n, newpos);
+        i = (valid < 0) ? activity[n].budget : i + 1;
+        if(valid <= 0)
+          continue;
+
+        drops.emplace_back(newpos);
+        drops.back().prefetch(*this);
+
+      }
 
-    Drop drop(newpos);
+      PROFILE_FINE("descend");
 
-    while(drop.descend());
+      for(size_t d = 0; d < drops.size();){
+        if(drops[d].descend(*this, stats)){
+          drops[d].prefetch(*this);
+          d++;
+        }
+        else {
+          drops[d] = drops.back();
+          drops.pop_back();
+        }
+      }
+
+    }
+
+  }
+
+  else {
+
+    // Spawn positions are drawn serially, so the random sequence matches.
+    // Droplets reach every node, which must be generated and writable.
+
+    std::vector<glm::vec2> spawns;
+    for(int n = 0; n < quad::maparea; n++)
+    for(int i = 0; i < activity[n].budget; i++){
+      glm::vec2 newpos;
+      const int valid = spawn(n, newpos);
+      if(valid < 0) break;
+      if(valid > 0) spawns.push_back(newpos);
+    }
+
+    for(auto& node: map.nodes){
+      if(!node.generated)
+        map.generate(node);
+      map.unshare(node);
+    }
+
+    descend(spawns);
+
+  }
 
   }
 
   //Update Fields
-  for(auto& node: map.nodes)
-  for(auto [cell, pos]: node.s){
-    cell.discharge = (1.0f-lrate)*cell.discharge + lrate*cell.discharge_track;
-    cell.momentumx = (1.0f-lrate)*cell.momentumx + lrate*cell.momentumx_track;
-    cell.momentumy = (1.0f-lrate)*cell.momentumy + lrate*cell.momentumy_track;
+  //  The residual is the L1 change of the discharge average relative to its
+  //  magnitude. Once the terrain is steady it measures the spawning noise.
+
+  PROFILE("erode.fields");
+  double change = 0.0, total = 0.0;
+  for(int n = 0; n < quad::maparea; n++){
+    quad::node& node = map.nodes[n];
+    Spawner& spawner = spawners[n];
+    Activity& activity = this->activity[n];
+    if(activity.budget == 0) continue;
+    map.unshare(node);
+    double nodechange = 0.0, nodetotal = 0.0, nodeheight = 0.0;
+    const bool measured = activity.previous.size() == node.s.size();
+    activity.previous.resize(node.s.size());
+    for(auto [cell, pos]: node.s){
+      float& previous = activity.previous[math::flatten(pos, node.s.res)];
+      nodeheight += std::abs(cell.height - previous);
+      previous = cell.height;
+      const float discharge = cell.discharge;
+      cell.discharge = (1.0f-lrate)*cell.discharge + lrate*cell.discharge_track;
+      nodechange += std::abs(cell.discharge - discharge);
+      nodetotal += cell.discharge;
+      cell.momentumx = (1.0f-lrate)*cell.momentumx + lrate*cell.momentumx_track;
+      cell.momentumy = (1.0f-lrate)*cell.momentumy + lrate*cell.momentumy_track;
+      if(importance)
+        spawner.check(math::flatten(pos, node.s.res), cell.height);
+    }
+    change += nodechange;
+    total += nodetotal;
+    activity.measure(activity.drift, (nodetotal > 0.0) ? nodechange/nodetotal : 0.0);
+    if(measured) activity.measure(activity.height, nodeheight/activity.budget);
+    activity.converged = activity.height >= 0.0f && activity.height < steady && activity.drift < steadydrift;
+    if(!activity.converged) activity.idle = 0;
   }
 
+  residual = (total > 0.0) ? change/total : 0.0f;
+
 }
 
-void World::cascade(vec2 pos){
+int World::cascade(vec2 pos){
+
+  PROFILE_FINE("cascade");
 
   // Get Non-Out-of-Bounds Neighbors
 
@@ -108,41 +668,43 @@ void World::cascade(vec2 pos){
     float d;
   };
 
-  static Point sn[8];
+  Point sn[8];
   int num = 0;
+  int transfers = 0;
 
   ivec2 ipos = pos;
 
   for(auto& nn: n){
 
-    ivec2 npos = ipos + quad::lodsize*nn;
+    ivec2 npos = ipos + map.lod*nn;
 
-    if(World::map.oob(npos))
+    if(map.oob(npos))
       continue;
 
-    sn[num++] = { npos, World::map.get(npos)->get(npos)->height, length(vec2(nn)) };
+    sn[num++] = { npos, map.get(npos)->get(npos)->height, length(vec2(nn)) };
 
   }
 
   //Iterate over all sorted Neighbors
+  //  Insertion sort, as std::sort does for at most 16 elements
 
-  sort(std::begin(sn), std::begin(sn) + num, [&](const Point& a, const Point& b){
-    return a.h < b.h;
-  });
+  for(int i = 1; i < num; i++)
+  for(int j = i; j > 0 && sn[j].h < sn[j-1].h; j--)
+    std::swap(sn[j], sn[j-1]);
 
   for (int i = 0; i < num; ++i) {
 
     auto& npos = sn[i].pos;
 
     //Full Height-Different Between Positions!
-    float diff = World::map.get(ipos)->get(ipos)->height - sn[i].h;
+    float diff = map.get(ipos)->get(ipos)->height - sn[i].h;
     if(diff == 0)   //No Height Difference
       continue;
 
       //The Amount of Excess Difference!
     float excess = 0.0f;
     if(sn[i].h > 0.1){
-      excess = abs(diff) - sn[i].d*maxdiff * quad::lodsize;
+      excess = abs(diff) - sn[i].d*maxdiff * map.lod;
     } else {
       excess = abs(diff);
     }
@@ -155,16 +717,20 @@ void World::cascade(vec2 pos){
 
     //Cap by Maximum Transferrable Amount
     if(diff > 0){
-      World::map.get(ipos)->get(ipos)->height -= transfer;
-      World::map.get(npos)->get(npos)->height += transfer;
+      map.write(ipos)->height -= transfer;
+      map.write(npos)->height += transfer;
     }
     else{
-      World::map.get(ipos)->get(ipos)->height += transfer;
-      World::map.get(npos)->get(npos)->height -= transfer;
+      map.write(ipos)->height += transfer;
+      map.write(npos)->height -= transfer;
     }
 
+    transfers++;
+
   }
 
+  return transfers;
+
 }
 
 #endif